@@ -1,14 +1,18 @@
 #include "FormulaAST.h"
 
+#include "binary_io.h"
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <system_error>
 
 namespace ASTImpl {
 
@@ -67,17 +71,51 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+namespace {
+class RangeExpr;
+
+// The first byte of every node in the binary form of a tree, see
+// FormulaAST::Serialize. Children follow their parent (prefix order)
+enum class NodeTag : std::uint8_t {
+    Number,    // the double value
+    Cell,      // row and column
+    Range,     // rows and columns of both corners
+    Unary,     // the operator character, the operand
+    Binary,    // the operator character, both operands
+    Function,  // the AggregateFunction, the number of arguments, the arguments
+};
+}  // namespace
+
+// Nodes live in the Arena of their FormulaAST and are never destroyed one by
+// one, so every node type has to be trivially destructible: the destructor is
+// protected and not virtual, and children are plain pointers into the arena
 class Expr {
 public:
-    virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;   
-    virtual double Evaluate(FormulaAST::CellValueGetter get_cell_value) const = 0;
+    // offset is added to every cell and range, see FormulaAST::PrintFormula
+    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position offset) const = 0;   
+    virtual void Compile(Program& program) const = 0;
+    virtual void Serialize(std::string& out) const = 0;
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+    // Compiles a node below the one being compiled. The recursion is bounded
+    // here, before it gets deep enough to overflow the stack
+    static void CompileChild(const Expr* child, Program& program) {
+        if (++program.nesting >= FormulaAST::MAX_DEPTH) {
+            throw ParsingError("Formula is nested too deeply");
+        }
+        child->Compile(program);
+        --program.nesting;
+    }
+
+    // ranges are only allowed as function arguments, the functions look for them
+    virtual const RangeExpr* AsRange() const {
+        return nullptr;
+    }
+
+    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position offset,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -86,12 +124,15 @@ public:
             out << '(';
         }
 
-        DoPrintFormula(out, precedence);
+        DoPrintFormula(out, precedence, offset);
 
         if (parens_needed) {
             out << ')';
         }
     }
+
+protected:
+    ~Expr() = default;
 };
 
 namespace {
@@ -105,10 +146,10 @@ public:
     };
 
 public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+    explicit BinaryOpExpr(Type type, const Expr* lhs, const Expr* rhs)
         : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
+        , lhs_(lhs)
+        , rhs_(rhs) {
     }
 
     void Print(std::ostream& out) const override {
@@ -119,10 +160,10 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position offset) const override {
+        lhs_->PrintFormula(out, precedence, offset);
         out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+        rhs_->PrintFormula(out, precedence, offset, /* right_child = */ true);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -142,42 +183,39 @@ public:
         }
     }
 
-    double Evaluate(FormulaAST::CellValueGetter get_cell_value) const override {
-        double left_val = lhs_->Evaluate(get_cell_value);
-        double right_val = rhs_->Evaluate(get_cell_value);
-        double result;
-        
+    void Compile(Program& program) const override {
+        CompileChild(lhs_, program);
+        CompileChild(rhs_, program);
+
         switch (type_) {
             case Add:
-                result = left_val + right_val;
+                program.Emit(Program::OpCode::Add);
                 break;
             case Subtract:
-                result = left_val - right_val;
+                program.Emit(Program::OpCode::Subtract);
                 break;
             case Multiply:
-                result = left_val * right_val;
+                program.Emit(Program::OpCode::Multiply);
                 break;
             case Divide:
-                if (right_val == 0) {
-                    throw FormulaError(FormulaError::Category::Arithmetic);
-                }
-                result = left_val / right_val;
+                program.Emit(Program::OpCode::Divide);
                 break;
             default:
                 assert(false);
         }
-        
-        if (!std::isfinite(result)) {
-            throw FormulaError(FormulaError::Category::Arithmetic);
-        }
-        
-        return result;
+    }
+
+    void Serialize(std::string& out) const override {
+        WriteUint8(out, static_cast<std::uint8_t>(NodeTag::Binary));
+        WriteUint8(out, static_cast<std::uint8_t>(type_));
+        lhs_->Serialize(out);
+        rhs_->Serialize(out);
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    const Expr* lhs_;
+    const Expr* rhs_;
 };
 
 class UnaryOpExpr final : public Expr {
@@ -188,9 +226,9 @@ public:
     };
 
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+    explicit UnaryOpExpr(Type type, const Expr* operand)
         : type_(type)
-        , operand_(std::move(operand)) {
+        , operand_(operand) {
     }
 
     void Print(std::ostream& out) const override {
@@ -199,69 +237,240 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position offset) const override {
         out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+        operand_->PrintFormula(out, precedence, offset);
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_UNARY;
     }
 
-    double Evaluate(FormulaAST::CellValueGetter get_cell_value) const override {
-        double val = operand_->Evaluate(get_cell_value);
-        double result;
-        
+    void Compile(Program& program) const override {
+        CompileChild(operand_, program);
+
         switch (type_) {
             case UnaryPlus:
-                result = val;
+                // the value is passed through as is
                 break;
             case UnaryMinus:
-                result = -val;
+                program.Emit(Program::OpCode::Negate);
                 break;
             default:
                 assert(false);
         }
-               
-        return result;
+    }
+
+    void Serialize(std::string& out) const override {
+        WriteUint8(out, static_cast<std::uint8_t>(NodeTag::Unary));
+        WriteUint8(out, static_cast<std::uint8_t>(type_));
+        operand_->Serialize(out);
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> operand_;
+    const Expr* operand_;
 };
 
 class CellExpr final : public Expr {
 public:
-    explicit CellExpr(const Position* cell)
+    explicit CellExpr(Position cell)
         : cell_(cell) {
     }
 
     void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
+        DoPrintFormula(out, EP_ATOM, {0, 0});
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position offset) const override {
+        const Position cell = ShiftPosition(cell_, offset);
+        if (!cell.IsValid()) {
             out << FormulaError::Category::Ref;
         } else {
-            out << cell_->ToString();
+            out << cell.ToString();
         }
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    void Compile(Program& program) const override {
+        auto it = std::lower_bound(program.cells.begin(), program.cells.end(), cell_);
+        assert(it != program.cells.end() && *it == cell_);
+        program.Emit(Program::OpCode::PushCell, static_cast<std::uint32_t>(it - program.cells.begin()));
+    }
+
+    void Serialize(std::string& out) const override {
+        WriteUint8(out, static_cast<std::uint8_t>(NodeTag::Cell));
+        WriteInt32(out, cell_.row);
+        WriteInt32(out, cell_.col);
+    }
+
+private:
+    Position cell_;
+};
+
+// A range argument of an aggregate function; it is never compiled on its own
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(Range range, std::uint32_t index)
+        : range_(range)
+        , index_(index) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << range_.ToString();
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position offset) const override {
+        out << ShiftRange(range_, offset).ToString();
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate(FormulaAST::CellValueGetter get_cell_value) const override { 
-        if(!cell_->IsValid()) {
-            throw FormulaError(FormulaError::Category::Ref);
+    void Compile(Program& /* program */) const override {
+        assert(false);
+    }
+
+    void Serialize(std::string& out) const override {
+        WriteUint8(out, static_cast<std::uint8_t>(NodeTag::Range));
+        WriteInt32(out, range_.from.row);
+        WriteInt32(out, range_.from.col);
+        WriteInt32(out, range_.to.row);
+        WriteInt32(out, range_.to.col);
+    }
+
+    const RangeExpr* AsRange() const override {
+        return this;
+    }
+
+    // the position of the range in FormulaAST::GetReferencedRanges()
+    std::uint32_t GetIndex() const {
+        return index_;
+    }
+
+private:
+    Range range_;
+    std::uint32_t index_;
+};
+
+struct FunctionName {
+    std::string_view name;
+    AggregateFunction function;
+};
+
+constexpr FunctionName FUNCTION_NAMES[] = {
+    {"SUM", AggregateFunction::Sum},
+    {"AVERAGE", AggregateFunction::Average},
+    {"MIN", AggregateFunction::Min},
+    {"MAX", AggregateFunction::Max},
+    {"COUNT", AggregateFunction::Count},
+};
+
+std::optional<AggregateFunction> FindFunction(std::string_view name) {
+    for (const FunctionName& entry : FUNCTION_NAMES) {
+        if (entry.name == name) {
+            return entry.function;
+        }
+    }
+    return std::nullopt;
+}
+
+std::string_view GetFunctionName(AggregateFunction function) {
+    for (const FunctionName& entry : FUNCTION_NAMES) {
+        if (entry.function == function) {
+            return entry.name;
+        }
+    }
+    assert(false);
+    return {};
+}
+
+class FunctionExpr final : public Expr {
+public:
+    // args points to arg_count nodes, the array is in the arena as well
+    explicit FunctionExpr(AggregateFunction function, const Expr* const* args, std::uint32_t arg_count)
+        : function_(function)
+        , args_(args)
+        , arg_count_(arg_count) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << GetFunctionName(function_);
+        for (const Expr* arg : GetArgs()) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position offset) const override {
+        out << GetFunctionName(function_) << '(';
+        bool first = true;
+        for (const Expr* arg : GetArgs()) {
+            if (!first) {
+                out << ',';
+            }
+            first = false;
+            // the arguments are delimited by commas, they never need parens
+            arg->PrintFormula(out, EP_ADD, offset);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    void Compile(Program& program) const override {
+        Program::Call call{function_};
+        call.first_range = static_cast<std::uint32_t>(program.call_ranges.size());
+        for (const Expr* arg : GetArgs()) {
+            if (const RangeExpr* range = arg->AsRange()) {
+                program.call_ranges.push_back(range->GetIndex());
+                ++call.range_count;
+            } else {
+                CompileChild(arg, program);
+                ++call.value_count;
+            }
+        }
+
+        program.calls.push_back(call);
+        program.Emit(Program::OpCode::Aggregate, static_cast<std::uint32_t>(program.calls.size() - 1));
+    }
+
+    void Serialize(std::string& out) const override {
+        WriteUint8(out, static_cast<std::uint8_t>(NodeTag::Function));
+        WriteUint8(out, static_cast<std::uint8_t>(function_));
+        WriteUint32(out, arg_count_);
+        for (const Expr* arg : GetArgs()) {
+            arg->Serialize(out);
         }
-        return get_cell_value(*cell_);
     }
 
 private:
-    const Position* cell_;
+    struct Args {
+        const Expr* const* first;
+        const Expr* const* last;
+
+        const Expr* const* begin() const {
+            return first;
+        }
+        const Expr* const* end() const {
+            return last;
+        }
+    };
+
+    Args GetArgs() const {
+        return {args_, args_ + arg_count_};
+    }
+
+    AggregateFunction function_;
+    const Expr* const* args_;
+    std::uint32_t arg_count_;
 };
 
 class NumberExpr final : public Expr {
@@ -274,7 +483,7 @@ public:
         out << value_;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position /* offset */) const override {
         out << value_;
     }
 
@@ -282,8 +491,14 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate(FormulaAST::CellValueGetter get_cell_value) const override {    
-        return value_;
+    void Compile(Program& program) const override {
+        program.Emit(Program::OpCode::PushNumber, static_cast<std::uint32_t>(program.constants.size()));
+        program.constants.push_back(value_);
+    }
+
+    void Serialize(std::string& out) const override {
+        WriteUint8(out, static_cast<std::uint8_t>(NodeTag::Number));
+        WriteDouble(out, value_);
     }
 
 private:
@@ -292,23 +507,28 @@ private:
 
 class ParseASTListener final : public FormulaBaseListener {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
+    const Expr* GetRoot() const {
         assert(args_.size() == 1);
-        auto root = std::move(args_.front());
-        args_.clear();
+        return args_.front();
+    }
 
-        return root;
+    Arena MoveArena() {
+        return std::move(arena_);
     }
 
-    std::forward_list<Position> MoveCells() {
+    std::vector<Position> MoveCells() {
         return std::move(cells_);
     }
 
+    std::vector<Range> MoveRanges() {
+        return std::move(ranges_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
 
-        auto operand = std::move(args_.back());
+        const Expr* operand = args_.back();
 
         UnaryOpExpr::Type type;
         if (ctx->SUB()) {
@@ -318,8 +538,7 @@ public:
             type = UnaryOpExpr::UnaryPlus;
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        args_.back() = arena_.Make<UnaryOpExpr>(type, operand);
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -331,8 +550,7 @@ public:
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        args_.push_back(arena_.Make<NumberExpr>(value));
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
@@ -342,18 +560,17 @@ public:
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+        cells_.push_back(value);
+        args_.push_back(arena_.Make<CellExpr>(value));
     }
 
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
-        auto rhs = std::move(args_.back());
+        const Expr* rhs = args_.back();
         args_.pop_back();
 
-        auto lhs = std::move(args_.back());
+        const Expr* lhs = args_.back();
 
         BinaryOpExpr::Type type;
         if (ctx->ADD()) {
@@ -367,8 +584,32 @@ public:
             type = BinaryOpExpr::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        args_.back() = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
+    }
+
+    void exitRangeArg(FormulaParser::RangeArgContext* ctx) override {
+        auto value_str = ctx->RANGE()->getSymbol()->getText();
+        auto value = Range::FromString(value_str);
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid range: " + value_str);
+        }
+
+        args_.push_back(arena_.Make<RangeExpr>(value, static_cast<std::uint32_t>(ranges_.size())));
+        ranges_.push_back(value);
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        const size_t arg_count = ctx->arg().size();
+        assert(args_.size() >= arg_count);
+
+        auto function = FindFunction(ctx->FUNCTION()->getSymbol()->getText());
+        assert(function.has_value());
+
+        auto first_arg = args_.end() - arg_count;
+        const Expr* const* args = arena_.Copy(&*first_arg, arg_count);
+        args_.erase(first_arg, args_.end());
+
+        args_.push_back(arena_.Make<FunctionExpr>(*function, args, static_cast<std::uint32_t>(arg_count)));
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -376,8 +617,10 @@ public:
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    Arena arena_;
+    std::vector<const Expr*> args_;
+    std::vector<Position> cells_;
+    std::vector<Range> ranges_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -390,9 +633,525 @@ public:
     }
 };
 
+// Hand-written recursive-descent parser for the Formula.g4 grammar.
+// It builds exactly the tree ParseASTListener would build for the same input,
+// but without the ANTLR machinery. On anything it does not accept it gives up
+// (Parse() returns nullptr) and the caller falls back to ANTLR, so syntax
+// errors are always reported by the generated parser. Nesting deeper than
+// FormulaAST::MAX_DEPTH is the one thing it rejects itself: the recursion
+// of either parser would overflow the stack first.
+class FastParser {
+public:
+    explicit FastParser(std::string_view text)
+        : text_(text) {
+    }
+
+    const Expr* Parse() {
+        Next();
+        const Expr* root = ParseAdditive();
+        if (!root || token_.kind != TokenKind::End) {
+            return nullptr;
+        }
+        return root;
+    }
+
+    Arena MoveArena() {
+        return std::move(arena_);
+    }
+
+    std::vector<Position> MoveCells() {
+        return std::move(cells_);
+    }
+
+    std::vector<Range> MoveRanges() {
+        return std::move(ranges_);
+    }
+
+    // see MakeRelativeFormulaKey
+    std::optional<std::string> MakeRelativeKey(Position anchor) {
+        std::string key;
+        key.reserve(text_.size() + 8);
+        auto append_cell = [&key, anchor](Position cell) {
+            key += 'R';
+            key += std::to_string(cell.row - anchor.row);
+            key += 'C';
+            key += std::to_string(cell.col - anchor.col);
+        };
+
+        for (Next(); token_.kind != TokenKind::End; Next()) {
+            if (!key.empty()) {
+                key += ' ';
+            }
+            switch (token_.kind) {
+                case TokenKind::Invalid:
+                    return std::nullopt;
+                case TokenKind::Cell:
+                    append_cell(token_.cell);
+                    break;
+                case TokenKind::Range:
+                    append_cell(token_.range.from);
+                    key += ':';
+                    append_cell(token_.range.to);
+                    break;
+                default:
+                    key += text_.substr(token_start_, pos_ - token_start_);
+            }
+        }
+        return key;
+    }
+
+private:
+    enum class TokenKind {
+        End,
+        Number,
+        Cell,
+        Range,
+        Function,
+        Comma,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        LeftParen,
+        RightParen,
+        Invalid,
+    };
+
+    struct Token {
+        TokenKind kind = TokenKind::Invalid;
+        double number = 0;
+        Position cell;
+        Range range;
+        AggregateFunction function = AggregateFunction::Sum;
+    };
+
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    size_t SkipDigits() {
+        size_t start = pos_;
+        while (pos_ < text_.size() && IsDigit(text_[pos_])) {
+            ++pos_;
+        }
+        return pos_ - start;
+    }
+
+    size_t SkipUpper() {
+        size_t start = pos_;
+        while (pos_ < text_.size() && IsUpper(text_[pos_])) {
+            ++pos_;
+        }
+        return pos_ - start;
+    }
+
+    // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    void LexNumber() {
+        size_t start = pos_;
+        size_t int_digits = SkipDigits();
+        if (pos_ < text_.size() && text_[pos_] == '.') {
+            ++pos_;
+            if (SkipDigits() == 0) {
+                return;
+            }
+        } else if (int_digits == 0) {
+            return;
+        }
+
+        if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+            ++pos_;
+            if (pos_ < text_.size() && (text_[pos_] == '+' || text_[pos_] == '-')) {
+                ++pos_;
+            }
+            if (SkipDigits() == 0) {
+                return;
+            }
+        }
+
+        const char* first = text_.data() + start;
+        const char* last = text_.data() + pos_;
+        auto [ptr, ec] = std::from_chars(first, last, token_.number);
+        if (ec == std::errc() && ptr == last) {
+            token_.kind = TokenKind::Number;
+        }
+    }
+
+    // CELL: [A-Z]+[0-9]+
+    // RANGE: [A-Z]+[0-9]+ ':' [A-Z]+[0-9]+
+    // FUNCTION: one of FUNCTION_NAMES (no digits, so never a prefix of a cell)
+    void LexName() {
+        size_t start = pos_;
+        SkipUpper();
+        if (SkipDigits() == 0) {
+            if (auto function = FindFunction(text_.substr(start, pos_ - start))) {
+                token_.kind = TokenKind::Function;
+                token_.function = *function;
+            }
+            return;
+        }
+
+        if (pos_ < text_.size() && text_[pos_] == ':') {
+            ++pos_;
+            if (SkipUpper() == 0 || SkipDigits() == 0) {
+                return;
+            }
+            token_.range = Range::FromString(text_.substr(start, pos_ - start));
+            if (token_.range.IsValid()) {
+                token_.kind = TokenKind::Range;
+            }
+            return;
+        }
+
+        token_.cell = Position::FromString(text_.substr(start, pos_ - start));
+        if (token_.cell.IsValid()) {
+            token_.kind = TokenKind::Cell;
+        }
+    }
+
+    void Next() {
+        while (pos_ < text_.size() &&
+               (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r')) {
+            ++pos_;
+        }
+
+        token_ = Token{};
+        token_start_ = pos_;
+        if (pos_ == text_.size()) {
+            token_.kind = TokenKind::End;
+            return;
+        }
+
+        char c = text_[pos_];
+        if (IsDigit(c) || c == '.') {
+            LexNumber();
+            return;
+        }
+        if (IsUpper(c)) {
+            LexName();
+            return;
+        }
+
+        ++pos_;
+        switch (c) {
+            case '+':
+                token_.kind = TokenKind::Add;
+                break;
+            case '-':
+                token_.kind = TokenKind::Sub;
+                break;
+            case '*':
+                token_.kind = TokenKind::Mul;
+                break;
+            case '/':
+                token_.kind = TokenKind::Div;
+                break;
+            case '(':
+                token_.kind = TokenKind::LeftParen;
+                break;
+            case ')':
+                token_.kind = TokenKind::RightParen;
+                break;
+            case ',':
+                token_.kind = TokenKind::Comma;
+                break;
+            default:
+                break;
+        }
+    }
+
+    // expr (ADD | SUB) expr
+    const Expr* ParseAdditive() {
+        const Expr* lhs = ParseMultiplicative();
+        while (lhs && (token_.kind == TokenKind::Add || token_.kind == TokenKind::Sub)) {
+            auto type = token_.kind == TokenKind::Add ? BinaryOpExpr::Add : BinaryOpExpr::Subtract;
+            Next();
+            const Expr* rhs = ParseMultiplicative();
+            if (!rhs) {
+                return nullptr;
+            }
+            lhs = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
+        }
+        return lhs;
+    }
+
+    // expr (MUL | DIV) expr
+    const Expr* ParseMultiplicative() {
+        const Expr* lhs = ParseUnary();
+        while (lhs && (token_.kind == TokenKind::Mul || token_.kind == TokenKind::Div)) {
+            auto type = token_.kind == TokenKind::Mul ? BinaryOpExpr::Multiply : BinaryOpExpr::Divide;
+            Next();
+            const Expr* rhs = ParseUnary();
+            if (!rhs) {
+                return nullptr;
+            }
+            lhs = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
+        }
+        return lhs;
+    }
+
+    // (ADD | SUB) expr binds tighter than any binary operation
+    const Expr* ParseUnary() {
+        if (token_.kind == TokenKind::Add || token_.kind == TokenKind::Sub) {
+            auto type = token_.kind == TokenKind::Add ? UnaryOpExpr::UnaryPlus : UnaryOpExpr::UnaryMinus;
+            Next();
+            Enter();
+            const Expr* operand = ParseUnary();
+            --depth_;
+            if (!operand) {
+                return nullptr;
+            }
+            return arena_.Make<UnaryOpExpr>(type, operand);
+        }
+        return ParsePrimary();
+    }
+
+    // FUNCTION '(' arg (',' arg)* ')', where arg is RANGE | expr
+    const Expr* ParseFunction() {
+        Enter();
+        const AggregateFunction function = token_.function;
+        Next();
+        if (token_.kind != TokenKind::LeftParen) {
+            return nullptr;
+        }
+
+        std::vector<const Expr*> args;
+        do {
+            Next();
+            if (token_.kind == TokenKind::Range) {
+                args.push_back(arena_.Make<RangeExpr>(token_.range, static_cast<std::uint32_t>(ranges_.size())));
+                ranges_.push_back(token_.range);
+                Next();
+            } else if (const Expr* arg = ParseAdditive()) {
+                args.push_back(arg);
+            } else {
+                return nullptr;
+            }
+        } while (token_.kind == TokenKind::Comma);
+
+        if (token_.kind != TokenKind::RightParen) {
+            return nullptr;
+        }
+        Next();
+        --depth_;
+        return arena_.Make<FunctionExpr>(function, arena_.Copy(args.data(), args.size()),
+                                         static_cast<std::uint32_t>(args.size()));
+    }
+
+    // Called on every unary operator, '(' and function call: these are what
+    // the parser recurses on. The caller decrements depth_ on the way back
+    void Enter() {
+        if (++depth_ >= FormulaAST::MAX_DEPTH) {
+            throw ParsingError("Formula is nested too deeply");
+        }
+    }
+
+    // '(' expr ')' | FUNCTION '(' ... ')' | CELL | NUMBER
+    const Expr* ParsePrimary() {
+        switch (token_.kind) {
+            case TokenKind::LeftParen: {
+                Next();
+                Enter();
+                const Expr* inner = ParseAdditive();
+                --depth_;
+                if (!inner || token_.kind != TokenKind::RightParen) {
+                    return nullptr;
+                }
+                Next();
+                return inner;
+            }
+            case TokenKind::Function:
+                return ParseFunction();
+            case TokenKind::Cell: {
+                cells_.push_back(token_.cell);
+                Next();
+                return arena_.Make<CellExpr>(cells_.back());
+            }
+            case TokenKind::Number: {
+                double value = token_.number;
+                Next();
+                return arena_.Make<NumberExpr>(value);
+            }
+            default:
+                return nullptr;
+        }
+    }
+
+    std::string_view text_;
+    size_t pos_ = 0;
+    size_t token_start_ = 0;
+    Token token_;
+    Arena arena_;
+    std::vector<Position> cells_;
+    std::vector<Range> ranges_;
+    size_t depth_ = 0;
+};
+
+// Rebuilds a tree from the binary form written by Expr::Serialize. The
+// nodes are read in a loop with an explicit stack of the unfinished ones, so
+// malformed data cannot overflow the call stack
+class ASTReader {
+public:
+    explicit ASTReader(BinaryReader& in)
+        : in_(in) {
+    }
+
+    const Expr* Read() {
+        while (true) {
+            // the same limit as for a parsed formula, see FormulaAST::MAX_DEPTH
+            if (open_.size() >= FormulaAST::MAX_DEPTH) {
+                throw BinaryFormatError("Formula is nested too deeply");
+            }
+            const bool range_allowed = !open_.empty() && open_.back().tag == NodeTag::Function;
+            const Expr* expr = ReadNode(range_allowed);
+
+            // a finished node may be the last child of its parent, which then
+            // is finished as well
+            while (expr) {
+                if (open_.empty()) {
+                    return expr;
+                }
+                children_.push_back(expr);
+                const OpenNode& node = open_.back();
+                if (children_.size() - node.first_child < node.child_count) {
+                    break;
+                }
+                expr = Finish(node);
+                open_.pop_back();
+            }
+        }
+    }
+
+    Arena MoveArena() {
+        return std::move(arena_);
+    }
+
+    std::vector<Position> MoveCells() {
+        return std::move(cells_);
+    }
+
+    std::vector<Range> MoveRanges() {
+        return std::move(ranges_);
+    }
+
+private:
+    // an operator or a function whose operands are still being read
+    struct OpenNode {
+        NodeTag tag;
+        std::uint8_t type;  // the operator character or the AggregateFunction
+        std::uint32_t child_count;
+        size_t first_child;  // where its operands start in children_
+    };
+
+    // Returns a leaf, or nullptr after opening a node that has operands
+    const Expr* ReadNode(bool range_allowed) {
+        const auto tag = static_cast<NodeTag>(in_.ReadUint8());
+        switch (tag) {
+            case NodeTag::Number:
+                return arena_.Make<NumberExpr>(in_.ReadDouble());
+            case NodeTag::Cell: {
+                const Position cell = ReadPosition();
+                cells_.push_back(cell);
+                return arena_.Make<CellExpr>(cell);
+            }
+            case NodeTag::Range: {
+                const Position from = ReadPosition();
+                const Range range{from, ReadPosition()};
+                if (!range_allowed || !range.IsValid()) {
+                    throw BinaryFormatError("Invalid range in a formula");
+                }
+                ranges_.push_back(range);
+                return arena_.Make<RangeExpr>(range, static_cast<std::uint32_t>(ranges_.size() - 1));
+            }
+            case NodeTag::Unary: {
+                const auto type = static_cast<UnaryOpExpr::Type>(in_.ReadUint8());
+                if (type != UnaryOpExpr::UnaryPlus && type != UnaryOpExpr::UnaryMinus) {
+                    throw BinaryFormatError("Invalid unary operator in a formula");
+                }
+                open_.push_back({tag, static_cast<std::uint8_t>(type), 1, children_.size()});
+                return nullptr;
+            }
+            case NodeTag::Binary: {
+                const auto type = static_cast<BinaryOpExpr::Type>(in_.ReadUint8());
+                if (type != BinaryOpExpr::Add && type != BinaryOpExpr::Subtract
+                    && type != BinaryOpExpr::Multiply && type != BinaryOpExpr::Divide) {
+                    throw BinaryFormatError("Invalid binary operator in a formula");
+                }
+                open_.push_back({tag, static_cast<std::uint8_t>(type), 2, children_.size()});
+                return nullptr;
+            }
+            case NodeTag::Function: {
+                const auto function = static_cast<AggregateFunction>(in_.ReadUint8());
+                if (function > AggregateFunction::Count) {
+                    throw BinaryFormatError("Invalid function in a formula");
+                }
+                const std::uint32_t arg_count = in_.ReadUint32();
+                if (arg_count == 0) {
+                    return arena_.Make<FunctionExpr>(function, nullptr, 0);
+                }
+                open_.push_back({tag, static_cast<std::uint8_t>(function), arg_count, children_.size()});
+                return nullptr;
+            }
+        }
+        throw BinaryFormatError("Invalid formula node");
+    }
+
+    // Builds the node once all its operands are read and takes them off children_
+    const Expr* Finish(const OpenNode& node) {
+        const Expr* const* operands = children_.data() + node.first_child;
+        const Expr* expr = nullptr;
+        switch (node.tag) {
+            case NodeTag::Unary:
+                expr = arena_.Make<UnaryOpExpr>(static_cast<UnaryOpExpr::Type>(node.type), operands[0]);
+                break;
+            case NodeTag::Binary:
+                expr = arena_.Make<BinaryOpExpr>(static_cast<BinaryOpExpr::Type>(node.type), operands[0],
+                                                 operands[1]);
+                break;
+            default:
+                expr = arena_.Make<FunctionExpr>(static_cast<AggregateFunction>(node.type),
+                                                 arena_.Copy(operands, node.child_count), node.child_count);
+        }
+        children_.resize(node.first_child);
+        return expr;
+    }
+
+    Position ReadPosition() {
+        const int row = in_.ReadInt32();
+        const Position pos{row, in_.ReadInt32()};
+        if (!pos.IsValid()) {
+            throw BinaryFormatError("Invalid position in a formula");
+        }
+        return pos;
+    }
+
+    BinaryReader& in_;
+    Arena arena_;
+    std::vector<Position> cells_;
+    std::vector<Range> ranges_;
+    std::vector<OpenNode> open_;
+    std::vector<const Expr*> children_;
+};
+
 }  // namespace
 }  // namespace ASTImpl
 
+std::optional<FormulaAST> TryParseFormulaASTFast(std::string_view in) {
+    ASTImpl::FastParser parser(in);
+    const ASTImpl::Expr* root = parser.Parse();
+    if (!root) {
+        return std::nullopt;
+    }
+    return FormulaAST(parser.MoveArena(), root, parser.MoveCells(), parser.MoveRanges());
+}
+
+std::optional<std::string> MakeRelativeFormulaKey(std::string_view in, Position anchor) {
+    return ASTImpl::FastParser(in).MakeRelativeKey(anchor);
+}
+
 FormulaAST ParseFormulaAST(std::istream& in) {
     using namespace antlr4;
 
@@ -414,16 +1173,39 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(listener.MoveArena(), listener.GetRoot(), listener.MoveCells(), listener.MoveRanges());
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
+    if (auto ast = TryParseFormulaASTFast(in_str)) {
+        return std::move(*ast);
+    }
+
+    // ANTLR and the walk over its tree recurse on operators and parentheses,
+    // and the fast parser may have given up before it saw how deep they go
+    const auto operators = std::count_if(in_str.begin(), in_str.end(), [](char c) {
+        return c == '+' || c == '-' || c == '*' || c == '/' || c == '(';
+    });
+    if (static_cast<size_t>(operators) >= FormulaAST::MAX_DEPTH) {
+        throw ParsingError("Formula is too complex");
+    }
+
     std::istringstream in(in_str);
     return ParseFormulaAST(in);
 }
 
+void FormulaAST::Serialize(std::string& out) const {
+    root_expr_->Serialize(out);
+}
+
+FormulaAST FormulaAST::Deserialize(BinaryReader& in) {
+    ASTImpl::ASTReader reader(in);
+    const ASTImpl::Expr* root = reader.Read();
+    return FormulaAST(reader.MoveArena(), root, reader.MoveCells(), reader.MoveRanges());
+}
+
 void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
+    for (auto cell : program_.cells) {
         out << cell.ToString() << ' ';
     }
 }
@@ -432,22 +1214,390 @@ void FormulaAST::Print(std::ostream& out) const {
     root_expr_->Print(out);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position offset) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, offset);
 }
 
-double FormulaAST::Execute(FormulaAST::CellValueGetter get_cell_value) const {
-    return root_expr_->Evaluate(get_cell_value);
+void ASTImpl::Program::Emit(OpCode op, std::uint32_t operand) {
+    if (Fold(op)) {
+        return;
+    }
+    code.push_back({op, operand});
+
+    switch (op) {
+        case OpCode::PushNumber:
+        case OpCode::PushCell:
+            max_depth = std::max(max_depth, ++depth);
+            break;
+        case OpCode::Negate:
+            break;
+        case OpCode::Aggregate:
+            // the value arguments are replaced by the result
+            depth = depth + 1 - calls[operand].value_count;
+            max_depth = std::max(max_depth, depth);
+            break;
+        default:
+            --depth;  // binary operations pop two values and push one
+    }
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+bool ASTImpl::Program::Fold(OpCode op) {
+    // Folding must not change any result, so it only does what the stack
+    // machine would do with the same numbers in the same order. An operation
+    // that would fail (division by zero, a non-finite result) is left in the
+    // program and fails at run time, after the errors of the operands before
+    // it, just like it did without folding.
+    auto constant_at = [this](size_t from_end) -> double* {
+        if (code.size() < from_end) {
+            return nullptr;
+        }
+        const Instruction& instruction = code[code.size() - from_end];
+        return instruction.code == OpCode::PushNumber ? &constants[instruction.operand] : nullptr;
+    };
+    // constants are only added at the end and a folded constant is always
+    // the last one, so dropping the last push drops the last constant too
+    auto drop_last_push = [this] {
+        assert(code.back().operand == constants.size() - 1);
+        code.pop_back();
+        constants.pop_back();
+        --depth;
+    };
+
+    switch (op) {
+        case OpCode::Negate:
+            if (double* value = constant_at(1)) {
+                *value = -*value;
+                return true;
+            }
+            if (!code.empty() && code.back().code == OpCode::Negate) {
+                // --x is x
+                code.pop_back();
+                return true;
+            }
+            return false;
+
+        case OpCode::Add:
+        case OpCode::Subtract:
+        case OpCode::Multiply:
+        case OpCode::Divide: {
+            const double* rhs = constant_at(1);
+            if (!rhs) {
+                return false;
+            }
+            if (double* lhs = constant_at(2)) {
+                double result;
+                switch (op) {
+                    case OpCode::Add:
+                        result = *lhs + *rhs;
+                        break;
+                    case OpCode::Subtract:
+                        result = *lhs - *rhs;
+                        break;
+                    case OpCode::Multiply:
+                        result = *lhs * *rhs;
+                        break;
+                    default:
+                        if (*rhs == 0) {
+                            return false;
+                        }
+                        result = *lhs / *rhs;
+                }
+                if (!std::isfinite(result)) {
+                    return false;
+                }
+                *lhs = result;
+                drop_last_push();
+                return true;
+            }
+            // x*1, x/1 and x-0 are not reduced to x: a text cell can hold
+            // inf or nan, and the operation is what turns them into #ARITHM!
+            return false;
+        }
+
+        default:
+            return false;
+    }
+}
+
+size_t ASTImpl::Program::GetHeapBytes() const {
+    return code.capacity() * sizeof(Instruction) + constants.capacity() * sizeof(double)
+           + cells.capacity() * sizeof(Position) + calls.capacity() * sizeof(Call)
+           + call_ranges.capacity() * sizeof(std::uint32_t);
+}
+
+void RangeSummary::Add(double value) {
+    Add(&value, 1);
+}
+
+void RangeSummary::Add(const double* values, size_t size) {
+    if (size == 0) {
+        return;
+    }
+
+    // independent lanes, so that the additions do not form one dependency
+    // chain and the loop maps onto vector registers
+    constexpr size_t LANES = 4;
+    const double low = count > 0 ? min : values[0];
+    const double high = count > 0 ? max : values[0];
+    double sums[LANES] = {};
+    double lows[LANES];
+    double highs[LANES];
+    for (size_t lane = 0; lane < LANES; ++lane) {
+        lows[lane] = low;
+        highs[lane] = high;
+    }
+
+    size_t i = 0;
+    for (; i + LANES <= size; i += LANES) {
+        for (size_t lane = 0; lane < LANES; ++lane) {
+            const double value = values[i + lane];
+            sums[lane] += value;
+            lows[lane] = value < lows[lane] ? value : lows[lane];
+            highs[lane] = value > highs[lane] ? value : highs[lane];
+        }
+    }
+    for (; i < size; ++i) {
+        sums[0] += values[i];
+        lows[0] = std::min(lows[0], values[i]);
+        highs[0] = std::max(highs[0], values[i]);
+    }
+
+    for (size_t lane = 0; lane < LANES; ++lane) {
+        sum += sums[lane];
+    }
+    min = *std::min_element(lows, lows + LANES);
+    max = *std::max_element(highs, highs + LANES);
+    count += size;
+}
+
+void RangeSummary::Merge(const RangeSummary& other) {
+    if (other.count == 0) {
+        return;
+    }
+    if (count == 0) {
+        *this = other;
+        return;
+    }
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    count += other.count;
+}
+
+namespace {
+FormulaAST::Value ApplyFunction(AggregateFunction function, const RangeSummary& summary) {
+    switch (function) {
+        case AggregateFunction::Sum:
+            return summary.sum;
+        case AggregateFunction::Average:
+            if (summary.count == 0) {
+                return FormulaError(FormulaError::Category::Arithmetic);
+            }
+            return summary.sum / static_cast<double>(summary.count);
+        case AggregateFunction::Min:
+            return summary.count > 0 ? summary.min : 0.0;
+        case AggregateFunction::Max:
+            return summary.count > 0 ? summary.max : 0.0;
+        case AggregateFunction::Count:
+            return static_cast<double>(summary.count);
+    }
+    assert(false);
+    return 0.0;
+}
+}  // namespace
+
+FormulaAST::Value FormulaAST::Execute(const FormulaAST::CellValueGetter& get_cell_value,
+                                      const FormulaAST::RangeValueGetter& get_range_value,
+                                      Position offset) const {
+    return Run([&get_cell_value](size_t /* index */, Position cell) {
+        return get_cell_value(cell);
+    }, get_range_value, offset);
+}
+
+FormulaAST::Value FormulaAST::Execute(const FormulaAST::IndexedCellValueGetter& get_cell_value,
+                                      const FormulaAST::RangeValueGetter& get_range_value,
+                                      Position offset) const {
+    return Run([&get_cell_value](size_t index, Position cell) {
+        return get_cell_value.get(get_cell_value.context, index, cell);
+    }, get_range_value, offset);
+}
+
+template <typename CellGetter>
+FormulaAST::Value FormulaAST::Run(const CellGetter& get_cell_value,
+                                  const FormulaAST::RangeValueGetter& get_range_value,
+                                  Position offset) const {
+    using ASTImpl::Program;
+
+    // most formulas fit into the inline stack, long right-nested chains
+    // get a heap one
+    constexpr size_t INLINE_STACK_SIZE = 32;
+    double inline_stack[INLINE_STACK_SIZE];
+    std::vector<double> heap_stack;
+    double* stack = inline_stack;
+    if (program_.max_depth > INLINE_STACK_SIZE) {
+        heap_stack.resize(program_.max_depth);
+        stack = heap_stack.data();
+    }
+
+    size_t top = 0;
+    for (const Program::Instruction& instruction : program_.code) {
+        switch (instruction.code) {
+            case Program::OpCode::PushNumber:
+                stack[top++] = program_.constants[instruction.operand];
+                continue;
+
+            case Program::OpCode::PushCell: {
+                const Position cell = ShiftPosition(program_.cells[instruction.operand], offset);
+                if (!cell.IsValid()) {
+                    return FormulaError(FormulaError::Category::Ref);
+                }
+                auto value = get_cell_value(instruction.operand, cell);
+                if (const auto* error = std::get_if<FormulaError>(&value)) {
+                    return *error;
+                }
+                stack[top++] = std::get<double>(value);
+                continue;
+            }
+
+            case Program::OpCode::Negate:
+                stack[top - 1] = -stack[top - 1];
+                continue;
+
+            case Program::OpCode::Aggregate: {
+                const Program::Call& call = program_.calls[instruction.operand];
+                RangeSummary summary;
+                top -= call.value_count;
+                summary.Add(stack + top, call.value_count);
+
+                for (std::uint32_t i = 0; i < call.range_count; ++i) {
+                    const Range range = ShiftRange(ranges_[program_.call_ranges[call.first_range + i]], offset);
+                    auto result = get_range_value(range);
+                    if (const auto* error = std::get_if<FormulaError>(&result)) {
+                        return *error;
+                    }
+                    summary.Merge(std::get<RangeSummary>(result));
+                }
+
+                auto value = ApplyFunction(call.function, summary);
+                if (const auto* error = std::get_if<FormulaError>(&value)) {
+                    return *error;
+                }
+                stack[top++] = std::get<double>(value);
+                if (!std::isfinite(stack[top - 1])) {
+                    return FormulaError(FormulaError::Category::Arithmetic);
+                }
+                continue;
+            }
+
+            default:
+                break;
+        }
+
+        const double rhs = stack[--top];
+        double& result = stack[top - 1];
+        switch (instruction.code) {
+            case Program::OpCode::Add:
+                result += rhs;
+                break;
+            case Program::OpCode::Subtract:
+                result -= rhs;
+                break;
+            case Program::OpCode::Multiply:
+                result *= rhs;
+                break;
+            case Program::OpCode::Divide:
+                if (rhs == 0) {
+                    return FormulaError(FormulaError::Category::Arithmetic);
+                }
+                result /= rhs;
+                break;
+            default:
+                assert(false);
+        }
+
+        if (!std::isfinite(result)) {
+            return FormulaError(FormulaError::Category::Arithmetic);
+        }
+    }
+
+    assert(top == 1);
+    return stack[0];
+}
+
+namespace ASTImpl {
+
+Arena::Arena(Arena&& other) noexcept
+    : last_block_(std::exchange(other.last_block_, nullptr))
+    , next_(std::exchange(other.next_, nullptr))
+    , left_(std::exchange(other.left_, 0))
+    , next_block_size_(std::exchange(other.next_block_size_, FIRST_BLOCK_SIZE))
+    , allocated_(std::exchange(other.allocated_, 0)) {
+}
+
+Arena& Arena::operator=(Arena&& other) noexcept {
+    if (this != &other) {
+        Release();
+        last_block_ = std::exchange(other.last_block_, nullptr);
+        next_ = std::exchange(other.next_, nullptr);
+        left_ = std::exchange(other.left_, 0);
+        next_block_size_ = std::exchange(other.next_block_size_, FIRST_BLOCK_SIZE);
+        allocated_ = std::exchange(other.allocated_, 0);
+    }
+    return *this;
+}
+
+Arena::~Arena() {
+    Release();
+}
+
+void* Arena::Allocate(size_t size, size_t alignment) {
+    size_t padding = (alignment - reinterpret_cast<std::uintptr_t>(next_) % alignment) % alignment;
+    if (!next_ || padding + size > left_) {
+        // a new block, each twice the previous; the header keeps the blocks
+        // in a list, the data starts right after it
+        const size_t block_size = std::max(next_block_size_, size + alignment);
+        next_block_size_ *= 2;
+        auto* block = static_cast<Block*>(::operator new(sizeof(Block) + block_size));
+        allocated_ += sizeof(Block) + block_size;
+        block->previous = last_block_;
+        last_block_ = block;
+        next_ = reinterpret_cast<std::byte*>(block + 1);
+        left_ = block_size;
+        padding = (alignment - reinterpret_cast<std::uintptr_t>(next_) % alignment) % alignment;
+    }
+
+    void* result = next_ + padding;
+    next_ += padding + size;
+    left_ -= padding + size;
+    return result;
+}
+
+void Arena::Release() {
+    while (last_block_) {
+        ::operator delete(std::exchange(last_block_, last_block_->previous));
+    }
+    next_ = nullptr;
+    left_ = 0;
+    allocated_ = 0;
+}
+
+}  // namespace ASTImpl
+
+FormulaAST::FormulaAST(ASTImpl::Arena arena, const ASTImpl::Expr* root_expr, std::vector<Position> cells,
+                       std::vector<Range> ranges)
+    : arena_(std::move(arena))
+    , root_expr_(root_expr)
+    , ranges_(std::move(ranges)) {
+    // the cells are stored once, the program addresses them by index
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    program_.cells = std::move(cells);
+    root_expr_->Compile(program_);
 }
 
 FormulaAST::~FormulaAST() = default;
 
-const std::forward_list<Position>& FormulaAST::GetReferencedCells() const { 
-	return cells_; 
+size_t FormulaAST::GetHeapBytes() const {
+    return arena_.GetAllocatedBytes() + program_.GetHeapBytes() + ranges_.capacity() * sizeof(Range);
 }
+
@@ -3,13 +3,162 @@
 #include "FormulaLexer.h"
 #include "common.h"
 
-#include <forward_list>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <functional>
+#include <new>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// The numbers aggregate functions need from a range: the sum, the extremes
+// and how many values there were
+struct RangeSummary {
+    double sum = 0;
+    double min = 0;
+    double max = 0;
+    size_t count = 0;
+
+    void Add(double value);
+    // folds a contiguous array of values; the loop is written so that the
+    // compiler can vectorize it
+    void Add(const double* values, size_t size);
+    void Merge(const RangeSummary& other);
+};
+
+// The same formula may be shared by cells that differ only by a shift of all
+// references, e.g. =B1*C1 in A1 and =B2*C2 in A2. Such a formula is parsed
+// once and evaluated or printed with an offset added to every reference.
+inline Position ShiftPosition(Position pos, Position offset) {
+    return {pos.row + offset.row, pos.col + offset.col};
+}
+
+inline Range ShiftRange(Range range, Position offset) {
+    return {ShiftPosition(range.from, offset), ShiftPosition(range.to, offset)};
+}
+
+enum class AggregateFunction : std::uint8_t {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+class BinaryReader;
 
 namespace ASTImpl {
 class Expr;
-}
+
+// Bump allocator for the nodes of one formula tree. The nodes are only ever
+// created, the whole tree goes away together with the arena, so a formula
+// costs a block or two of memory instead of an allocation per node
+class Arena {
+public:
+    Arena() = default;
+    Arena(Arena&& other) noexcept;
+    Arena& operator=(Arena&& other) noexcept;
+    ~Arena();
+
+    template <typename T, typename... Args>
+    T* Make(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena objects are never destroyed");
+        return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // bytes taken from the heap by the blocks
+    size_t GetAllocatedBytes() const {
+        return allocated_;
+    }
+
+    // copies size objects into the arena
+    template <typename T>
+    const T* Copy(const T* values, size_t size) {
+        static_assert(std::is_trivially_copyable_v<T>, "arena arrays are copied bytewise");
+        if (size == 0) {
+            return nullptr;
+        }
+        void* memory = Allocate(sizeof(T) * size, alignof(T));
+        std::memcpy(memory, values, sizeof(T) * size);
+        return static_cast<const T*>(memory);
+    }
+
+private:
+    struct Block {
+        Block* previous;
+    };
+
+    static constexpr size_t FIRST_BLOCK_SIZE = 256;
+
+    void* Allocate(size_t size, size_t alignment);
+    void Release();
+
+    Block* last_block_ = nullptr;
+    std::byte* next_ = nullptr;
+    size_t left_ = 0;
+    size_t next_block_size_ = FIRST_BLOCK_SIZE;
+    size_t allocated_ = 0;
+};
+
+// The formula compiled into postfix form: a flat program for a stack
+// machine. Operands are kept in side tables and are addressed by index.
+struct Program {
+    enum class OpCode : std::uint8_t {
+        PushNumber,  // push constants[operand]
+        PushCell,    // push the value of cells[operand]
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+        Aggregate,   // pop calls[operand].value_count values, push the result
+    };
+
+    // an aggregate function call: its value arguments are on the stack, its
+    // ranges are call_ranges[first_range, first_range + range_count)
+    struct Call {
+        AggregateFunction function;
+        std::uint32_t value_count = 0;
+        std::uint32_t first_range = 0;
+        std::uint32_t range_count = 0;
+    };
+
+    struct Instruction {
+        OpCode code;
+        std::uint32_t operand = 0;
+    };
+
+    // Appends an instruction. Operations on constants are folded right away
+    // (see Fold), so the program may come out shorter than the tree
+    void Emit(OpCode code, std::uint32_t operand = 0);
+
+    // heap memory of the side tables
+    size_t GetHeapBytes() const;
+
+    std::vector<Instruction> code;
+    std::vector<double> constants;
+    std::vector<Position> cells;  // sorted, without repetitions
+    std::vector<Call> calls;
+    std::vector<std::uint32_t> call_ranges;  // indexes into FormulaAST ranges
+
+    // the deepest the evaluation stack gets while running the program
+    size_t max_depth = 0;
+    size_t depth = 0;
+    // the number of ancestors of the node being compiled
+    size_t nesting = 0;
+
+private:
+    // Replaces the tail of the program with an equivalent shorter one when
+    // code is applied to constants; returns false if nothing was folded
+    bool Fold(OpCode code);
+};
+}  // namespace ASTImpl
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
@@ -17,40 +166,99 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
+    // Either the number or the error that stopped the evaluation. Errors are
+    // returned as values, nothing is thrown while a formula is evaluated
+    using Value = std::variant<double, FormulaError>;
+
 	// Функтор для получения значений ячеек
-    using CellValueGetter = std::function<double(Position)>;
+    using CellValueGetter = std::function<Value(Position)>;
+
+    // Summary of the non-empty cells of a range, or the first error among them
+    using RangeResult = std::variant<RangeSummary, FormulaError>;
+    using RangeValueGetter = std::function<RangeResult(const Range&)>;
 
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    // Values of the referenced cells by their index in GetReferencedCells()
+    // (the shifted position is passed along). A plain function pointer with
+    // its context: reading a cell costs one indirect call and no lookup
+    struct IndexedCellValueGetter {
+        Value (*get)(const void* context, size_t index, Position cell);
+        const void* context;
+    };
+
+    // Formulas are parsed, compiled, printed and saved recursively, so a
+    // formula nested deeper than this is rejected when it is parsed or
+    // loaded. While parsing, parentheses and function calls count as levels
+    // too. Whatever can be set in a cell can be saved and loaded back
+    static constexpr size_t MAX_DEPTH = size_t{1} << 14;
+
+    // root_expr and all its nodes are allocated in arena
+    explicit FormulaAST(ASTImpl::Arena arena, const ASTImpl::Expr* root_expr,
+                        std::vector<Position> cells,
+                        std::vector<Range> ranges = {});
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(CellValueGetter get_cell_value) const;
+    // offset is added to every referenced cell and range, see ShiftPosition
+    Value Execute(const CellValueGetter& get_cell_value,
+                  const RangeValueGetter& get_range_value,
+                  Position offset = {0, 0}) const;
+    Value Execute(const IndexedCellValueGetter& get_cell_value,
+                  const RangeValueGetter& get_range_value,
+                  Position offset = {0, 0}) const;
 
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    void PrintFormula(std::ostream& out, Position offset = {0, 0}) const;
 
-    std::forward_list<Position>& GetCells() {
-        return cells_;
+    // the referenced cells, sorted and without repetitions
+    const std::vector<Position>& GetReferencedCells() const {
+        return program_.cells;
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    // ranges of the aggregate function arguments, in the order of appearance
+    const std::vector<Range>& GetReferencedRanges() const {
+        return ranges_;
     }
 
-    const std::forward_list<Position>& GetReferencedCells() const;
+    // heap memory of the tree, the program and the ranges
+    size_t GetHeapBytes() const;
+
+    // Appends the tree in a compact binary form (see binary_io.h)
+    void Serialize(std::string& out) const;
+
+    // Rebuilds a formula written by Serialize without parsing any text and
+    // advances in past it. Throws BinaryFormatError on malformed data
+    static FormulaAST Deserialize(BinaryReader& in);
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // get_cell_value(index, shifted position) reads a referenced cell
+    template <typename CellGetter>
+    Value Run(const CellGetter& get_cell_value, const RangeValueGetter& get_range_value,
+              Position offset) const;
+
+    // the tree is kept for printing, evaluation runs the compiled program
+    ASTImpl::Arena arena_;
+    const ASTImpl::Expr* root_expr_;
+    ASTImpl::Program program_;
 
-    // physically stores cells so that they can be
-    // efficiently traversed without going through
-    // the whole AST
-    std::forward_list<Position> cells_;
+    std::vector<Range> ranges_;
 };
 
+// Parses with the ANTLR-generated parser
 FormulaAST ParseFormulaAST(std::istream& in);
+
+// Tries the hand-written parser first and falls back to ANTLR only when it
+// gives up, so errors are still reported by ANTLR
 FormulaAST ParseFormulaAST(const std::string& in_str);
 
+// Hand-written parser for the same grammar; returns std::nullopt instead of
+// reporting an error
+std::optional<FormulaAST> TryParseFormulaASTFast(std::string_view in);
+
+// The formula with every reference written relative to anchor (R1C1 style)
+// and the tokens separated by single spaces. Formulas with equal keys differ
+// only by a shift of their references. Returns std::nullopt for a text the
+// lexer does not accept; such a formula is not shared.
+std::optional<std::string> MakeRelativeFormulaKey(std::string_view in, Position anchor);
+
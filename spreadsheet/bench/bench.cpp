@@ -0,0 +1,530 @@
+// Замеры производительности горячих путей листа.
+//
+// Запуск: spreadsheet_bench [--filter=ПОДСТРОКА] [--repetitions=N] [--format=text|json]
+//
+// Каждый сценарий повторяется repetitions раз на заново построенных данных;
+// данные строятся из фиксированных зёрен, поэтому запуски сравнимы между
+// собой. Измеряется только тело сценария, без подготовки. В отчёт идут
+// медиана и минимум времени, число обработанных элементов в секунду и
+// счётчики сценария (например, байт на ячейку). С --format=json отчёт
+// машиночитаемый: его можно сравнивать с сохранённым, чтобы ловить регрессии.
+
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// ---------- учёт памяти ----------
+
+// Все выделения через operator new считаются: перед блоком хранится его
+// размер. Так память на ячейку измеряется без внешних инструментов
+// (GCC видит в inline-замене пары new/free и ошибочно считает их несовместимыми)
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+namespace {
+std::atomic<long long> live_bytes{0};
+constexpr size_t HEADER_SIZE = alignof(std::max_align_t);
+}  // namespace
+
+void* operator new(size_t size) {
+    auto* block = static_cast<size_t*>(std::malloc(size + HEADER_SIZE));
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    *block = size;
+    live_bytes.fetch_add(static_cast<long long>(size), std::memory_order_relaxed);
+    return reinterpret_cast<char*>(block) + HEADER_SIZE;
+}
+
+void operator delete(void* ptr) noexcept {
+    if (!ptr) {
+        return;
+    }
+    auto* block = reinterpret_cast<size_t*>(static_cast<char*>(ptr) - HEADER_SIZE);
+    live_bytes.fetch_sub(static_cast<long long>(*block), std::memory_order_relaxed);
+    std::free(block);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+namespace {
+
+// ---------- каркас ----------
+
+class State {
+public:
+    // Измеряет время body; можно вызывать несколько раз, время складывается
+    template <typename Body>
+    void Measure(Body&& body) {
+        const auto start = std::chrono::steady_clock::now();
+        body();
+        seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void SetItems(size_t items) {
+        items_ = items;
+    }
+
+    void SetCounter(const std::string& name, double value) {
+        counters_[name] = value;
+    }
+
+    double GetSeconds() const {
+        return seconds_;
+    }
+
+    size_t GetItems() const {
+        return items_;
+    }
+
+    const std::map<std::string, double>& GetCounters() const {
+        return counters_;
+    }
+
+private:
+    double seconds_ = 0;
+    size_t items_ = 0;
+    std::map<std::string, double> counters_;
+};
+
+struct Benchmark {
+    std::string name;
+    std::function<void(State&)> run;
+};
+
+struct Result {
+    std::string name;
+    size_t repetitions = 0;
+    double median_seconds = 0;
+    double min_seconds = 0;
+    size_t items = 0;
+    std::map<std::string, double> counters;  // с последнего повтора
+};
+
+Result Run(const Benchmark& benchmark, size_t repetitions) {
+    std::vector<double> seconds;
+    Result result;
+    result.name = benchmark.name;
+    result.repetitions = repetitions;
+    for (size_t i = 0; i < repetitions; ++i) {
+        State state;
+        benchmark.run(state);
+        seconds.push_back(state.GetSeconds());
+        result.items = state.GetItems();
+        result.counters = state.GetCounters();
+    }
+    std::sort(seconds.begin(), seconds.end());
+    result.median_seconds = seconds[seconds.size() / 2];
+    result.min_seconds = seconds.front();
+    return result;
+}
+
+double ItemsPerSecond(const Result& result) {
+    return result.median_seconds > 0 ? result.items / result.median_seconds : 0;
+}
+
+void PrintText(std::ostream& output, const std::vector<Result>& results) {
+    output << std::left << std::setw(32) << "benchmark" << std::right << std::setw(14) << "median, ms"
+           << std::setw(14) << "min, ms" << std::setw(16) << "items/s" << "  counters\n";
+    for (const Result& result : results) {
+        output << std::left << std::setw(32) << result.name << std::right << std::fixed << std::setprecision(3)
+               << std::setw(14) << result.median_seconds * 1e3 << std::setw(14) << result.min_seconds * 1e3
+               << std::setprecision(0) << std::setw(16) << ItemsPerSecond(result) << ' ';
+        output.unsetf(std::ios::floatfield);
+        output << std::setprecision(6);
+        for (const auto& [name, value] : result.counters) {
+            output << ' ' << name << '=' << value;
+        }
+        output << '\n';
+    }
+}
+
+void PrintJson(std::ostream& output, const std::vector<Result>& results, size_t repetitions) {
+    output << std::setprecision(9);
+    output << "{\n  \"context\": {\"repetitions\": " << repetitions << "},\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& result = results[i];
+        output << (i > 0 ? "," : "") << "\n    {\"name\": \"" << result.name << '"'
+               << ", \"repetitions\": " << result.repetitions
+               << ", \"median_seconds\": " << result.median_seconds
+               << ", \"min_seconds\": " << result.min_seconds
+               << ", \"items\": " << result.items
+               << ", \"items_per_second\": " << ItemsPerSecond(result);
+        for (const auto& [name, value] : result.counters) {
+            output << ", \"" << name << "\": " << value;
+        }
+        output << '}';
+    }
+    output << "\n  ]\n}\n";
+}
+
+// ---------- данные ----------
+
+std::string CellName(Position pos) {
+    return pos.ToString();
+}
+
+// Случайная формула из чисел, ссылок, арифметики и функций от диапазонов
+std::string RandomFormula(std::mt19937& random, int depth = 0) {
+    std::uniform_int_distribution<int> kind(0, depth < 3 ? 5 : 1);
+    std::uniform_int_distribution<int> row(0, 999);
+    std::uniform_int_distribution<int> col(0, 99);
+    switch (kind(random)) {
+        case 0:
+            return std::to_string(row(random) / 8.0);
+        case 1:
+            return CellName({row(random), col(random)});
+        case 2:
+            return RandomFormula(random, depth + 1) + "+" + RandomFormula(random, depth + 1);
+        case 3:
+            return RandomFormula(random, depth + 1) + "*" + RandomFormula(random, depth + 1);
+        case 4:
+            return "(" + RandomFormula(random, depth + 1) + "-" + RandomFormula(random, depth + 1) + ")/2";
+        default: {
+            const Position from{row(random), col(random)};
+            const Position to{from.row + 10, from.col + 2};
+            return "SUM(" + CellName(from) + ":" + CellName(to) + "," + RandomFormula(random, depth + 1) + ")";
+        }
+    }
+}
+
+// Лист rows x cols: в первом столбце числа, в остальных формулы от соседей
+void FillTable(Sheet& sheet, int rows, int cols) {
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < rows; ++row) {
+        cells.push_back({{row, 0}, std::to_string(row * 0.5)});
+        for (int col = 1; col < cols; ++col) {
+            cells.push_back({{row, col}, "=" + CellName({row, col - 1}) + "*2+1"});
+        }
+    }
+    sheet.SetCells(std::move(cells));
+}
+
+// ---------- сценарии ----------
+
+constexpr int CHAIN_LENGTH = 16000;
+constexpr int FAN_OUT = 20000;
+constexpr int EDIT_ROUNDS = 10;
+
+void ParseFormulas(State& state) {
+    constexpr size_t COUNT = 20000;
+    std::mt19937 random(1);
+    std::vector<std::string> formulas;
+    for (size_t i = 0; i < COUNT; ++i) {
+        formulas.push_back(RandomFormula(random));
+    }
+    size_t references = 0;
+    state.Measure([&] {
+        for (const std::string& formula : formulas) {
+            references += ParseFormula(formula)->GetReferencedCells().size();
+        }
+    });
+    state.SetItems(COUNT);
+    state.SetCounter("references", static_cast<double>(references));
+}
+
+// A1 <- A2 <- ... : каждое изменение A1 пересчитывает всю цепочку
+void RecalculateDeepChain(State& state) {
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells{{{0, 0}, "0"}};
+    for (int row = 1; row < CHAIN_LENGTH; ++row) {
+        cells.push_back({{row, 0}, "=A" + std::to_string(row) + "+1"});
+    }
+    sheet.SetCells(std::move(cells));
+    const Position last{CHAIN_LENGTH - 1, 0};
+    sheet.GetCell(last)->GetValue();
+
+    state.Measure([&] {
+        for (int round = 1; round <= EDIT_ROUNDS; ++round) {
+            sheet.SetCell({0, 0}, std::to_string(round));
+            sheet.GetCell(last)->GetValue();
+        }
+    });
+    state.SetItems(static_cast<size_t>(EDIT_ROUNDS) * CHAIN_LENGTH);
+}
+
+// A1 и FAN_OUT формул, ссылающихся на него, в восьми столбцах
+Position FanOutPosition(int i) {
+    return {i / 8, 1 + i % 8};
+}
+
+Sheet& BuildFanOut(Sheet& sheet) {
+    std::vector<std::pair<Position, std::string>> cells{{{0, 0}, "0"}};
+    for (int i = 0; i < FAN_OUT; ++i) {
+        cells.push_back({FanOutPosition(i), "=A1*" + std::to_string(i)});
+    }
+    sheet.SetCells(std::move(cells));
+    return sheet;
+}
+
+void RecalculateWideFanOut(State& state) {
+    Sheet sheet;
+    BuildFanOut(sheet);
+    state.Measure([&] {
+        for (int round = 1; round <= EDIT_ROUNDS; ++round) {
+            sheet.SetCell({0, 0}, std::to_string(round));
+            for (int i = 0; i < FAN_OUT; ++i) {
+                sheet.GetCell(FanOutPosition(i))->GetValue();
+            }
+        }
+    });
+    state.SetItems(static_cast<size_t>(EDIT_ROUNDS) * FAN_OUT);
+}
+
+void RecalculateAllFanOut(State& state) {
+    Sheet sheet;
+    BuildFanOut(sheet);
+    state.Measure([&] {
+        for (int round = 1; round <= EDIT_ROUNDS; ++round) {
+            sheet.SetCell({0, 0}, std::to_string(round));
+            sheet.RecalculateAll();
+        }
+    });
+    state.SetItems(static_cast<size_t>(EDIT_ROUNDS) * FAN_OUT);
+}
+
+// Формулы с девятью ссылками: восемь ячеек своей строки и общая K1.
+// Замер - чтение ссылок при вычислении, items - прочитанные ссылки
+void RecalculateManyReferences(State& state) {
+    constexpr int ROWS = 4000;
+    constexpr int REFERENCES = 9;
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells{{{0, 10}, "0"}};
+    for (int row = 0; row < ROWS; ++row) {
+        std::string formula = "=K1";
+        for (int col = 0; col < REFERENCES - 1; ++col) {
+            cells.push_back({{row, col}, std::to_string(row + col)});
+            formula += '+' + Position{row, col}.ToString();
+        }
+        cells.push_back({{row, 9}, std::move(formula)});
+    }
+    sheet.SetCells(std::move(cells));
+    state.Measure([&] {
+        for (int round = 1; round <= EDIT_ROUNDS; ++round) {
+            sheet.SetCell({0, 10}, std::to_string(round));
+            sheet.RecalculateAll(1);
+        }
+    });
+    state.SetItems(static_cast<size_t>(EDIT_ROUNDS) * ROWS * REFERENCES);
+}
+
+// То же с пересчётом при записи (Sheet::RecalculationMode::EAGER)
+void RecalculateEagerFanOut(State& state) {
+    Sheet sheet;
+    sheet.SetRecalculationMode(Sheet::RecalculationMode::EAGER);
+    BuildFanOut(sheet);
+    state.Measure([&] {
+        for (int round = 1; round <= EDIT_ROUNDS; ++round) {
+            sheet.SetCell({0, 0}, std::to_string(round));
+            for (int i = 0; i < FAN_OUT; ++i) {
+                sheet.GetCell(FanOutPosition(i))->GetValue();
+            }
+        }
+    });
+    state.SetItems(static_cast<size_t>(EDIT_ROUNDS) * FAN_OUT);
+}
+
+// Запись в A1 того же числа в другом виде: зависимые не пересчитываются
+void RecalculateEagerCutoff(State& state) {
+    Sheet sheet;
+    sheet.SetRecalculationMode(Sheet::RecalculationMode::EAGER);
+    BuildFanOut(sheet);
+    state.Measure([&] {
+        for (int round = 1; round <= EDIT_ROUNDS; ++round) {
+            sheet.SetCell({0, 0}, round % 2 == 0 ? "0" : "0.0");
+        }
+    });
+    state.SetItems(static_cast<size_t>(EDIT_ROUNDS) * FAN_OUT);
+}
+
+// Запись в случайные ячейки по всему листу, в том числе в дальний угол
+void SetCellSparse(State& state) {
+    constexpr size_t COUNT = 5000;
+    std::mt19937 random(2);
+    std::uniform_int_distribution<int> row(0, Position::MAX_ROWS - 1);
+    std::uniform_int_distribution<int> col(0, Position::MAX_COLS - 1);
+    std::vector<Position> positions{{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}};
+    for (size_t i = 1; i < COUNT; ++i) {
+        positions.push_back({row(random), col(random)});
+    }
+
+    Sheet sheet;
+    state.Measure([&] {
+        for (Position pos : positions) {
+            sheet.SetCell(pos, "text");
+        }
+    });
+    state.SetItems(COUNT);
+}
+
+constexpr int TABLE_ROWS = 2000;
+constexpr int TABLE_COLS = 50;
+
+void GetPrintableSize(State& state) {
+    constexpr size_t CALLS = 1000000;
+    Sheet sheet;
+    FillTable(sheet, TABLE_ROWS, TABLE_COLS);
+    long long sum = 0;
+    state.Measure([&] {
+        for (size_t i = 0; i < CALLS; ++i) {
+            sum += sheet.GetPrintableSize().rows;
+        }
+    });
+    state.SetItems(CALLS);
+    state.SetCounter("rows", static_cast<double>(sum / static_cast<long long>(CALLS)));
+}
+
+void PrintValues(State& state) {
+    Sheet sheet;
+    FillTable(sheet, TABLE_ROWS, TABLE_COLS);
+    sheet.RecalculateAll();
+    std::ostringstream output;
+    state.Measure([&] {
+        sheet.PrintValues(output);
+    });
+    state.SetItems(static_cast<size_t>(TABLE_ROWS) * TABLE_COLS);
+    state.SetCounter("bytes", static_cast<double>(output.str().size()));
+}
+
+void PrintTexts(State& state) {
+    Sheet sheet;
+    FillTable(sheet, TABLE_ROWS, TABLE_COLS);
+    std::ostringstream output;
+    state.Measure([&] {
+        sheet.PrintTexts(output);
+    });
+    state.SetItems(static_cast<size_t>(TABLE_ROWS) * TABLE_COLS);
+    state.SetCounter("bytes", static_cast<double>(output.str().size()));
+}
+
+// Очистка ячеек, на которые ссылаются формулы: ячейка остаётся пустой
+// ради ссылок, зависимые сбрасывают кэш
+void ClearReferencedCells(State& state) {
+    constexpr int COUNT = 16000;
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < COUNT; ++row) {
+        cells.push_back({{row, 0}, std::to_string(row)});
+        cells.push_back({{row, 1}, "=A" + std::to_string(row + 1) + "*2"});
+    }
+    sheet.SetCells(std::move(cells));
+    sheet.RecalculateAll();
+
+    state.Measure([&] {
+        for (int row = 0; row < COUNT; ++row) {
+            sheet.ClearCell({row, 0});
+        }
+    });
+    state.SetItems(COUNT);
+}
+
+// Ячейки замеров памяти: по 16 в строке
+Position MemoryPosition(int i) {
+    return {i / 16, i % 16};
+}
+
+// Память на ячейку: сколько байт в куче добавляет лист после записи ячеек
+// с текстами text(номер ячейки)
+void MeasureMemory(State& state, const std::function<std::string(int i)>& text) {
+    constexpr int COUNT = 100000;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int i = 0; i < COUNT; ++i) {
+        cells.push_back({MemoryPosition(i), text(i)});
+    }
+
+    auto sheet = std::make_unique<Sheet>();
+    const long long before = live_bytes.load();
+    // копия освобождается внутри SetCells и потому не искажает замер
+    auto input = cells;
+    state.Measure([&] {
+        sheet->SetCells(std::move(input));
+    });
+    state.SetItems(COUNT);
+    state.SetCounter("bytes_per_cell", static_cast<double>(live_bytes.load() - before) / COUNT);
+}
+
+void MemoryPerTextCell(State& state) {
+    MeasureMemory(state, [](int i) {
+        return "text " + std::to_string(i);
+    });
+}
+
+void MemoryPerFormulaCell(State& state) {
+    // формулы разные и ссылаются на предыдущую ячейку, как в обычной таблице
+    MeasureMemory(state, [](int i) {
+        return i == 0 ? "=1" : "=" + CellName(MemoryPosition(i - 1)) + "+" + std::to_string(i);
+    });
+}
+
+const std::vector<Benchmark>& GetBenchmarks() {
+    static const std::vector<Benchmark> benchmarks{
+        {"parse_formula", ParseFormulas},
+        {"recalc_deep_chain", RecalculateDeepChain},
+        {"recalc_wide_fan_out", RecalculateWideFanOut},
+        {"recalc_all_fan_out", RecalculateAllFanOut},
+        {"recalc_eager_fan_out", RecalculateEagerFanOut},
+        {"recalc_many_references", RecalculateManyReferences},
+        {"recalc_eager_cutoff", RecalculateEagerCutoff},
+        {"set_cell_sparse", SetCellSparse},
+        {"get_printable_size", GetPrintableSize},
+        {"print_values", PrintValues},
+        {"print_texts", PrintTexts},
+        {"clear_referenced_cell", ClearReferencedCells},
+        {"memory_text_cell", MemoryPerTextCell},
+        {"memory_formula_cell", MemoryPerFormulaCell},
+    };
+    return benchmarks;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::string filter;
+    size_t repetitions = 5;
+    bool json = false;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg.substr(0, 9) == "--filter=") {
+            filter = arg.substr(9);
+        } else if (arg.substr(0, 14) == "--repetitions=") {
+            repetitions = std::max(1, std::atoi(argv[i] + 14));
+        } else if (arg == "--format=json") {
+            json = true;
+        } else if (arg != "--format=text") {
+            std::cerr << "Usage: " << argv[0] << " [--filter=TEXT] [--repetitions=N] [--format=text|json]\n";
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    for (const Benchmark& benchmark : GetBenchmarks()) {
+        if (benchmark.name.find(filter) != std::string::npos) {
+            results.push_back(Run(benchmark, repetitions));
+        }
+    }
+
+    if (json) {
+        PrintJson(std::cout, results, repetitions);
+    } else {
+        PrintText(std::cout, results);
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Двоичная запись и чтение для сохранённых листов (см. Sheet::Save).
+// Числа пишутся в порядке little-endian независимо от платформы, double -
+// своим 64-битным представлением IEEE 754. Ошибки - BinaryFormatError.
+
+inline void WriteUint8(std::string& out, std::uint8_t value) {
+    out.push_back(static_cast<char>(value));
+}
+
+inline void WriteUint32(std::string& out, std::uint32_t value) {
+    for (int shift = 0; shift < 32; shift += 8) {
+        out.push_back(static_cast<char>((value >> shift) & 0xFF));
+    }
+}
+
+inline void WriteInt32(std::string& out, std::int32_t value) {
+    WriteUint32(out, static_cast<std::uint32_t>(value));
+}
+
+inline void WriteDouble(std::string& out, double value) {
+    static_assert(sizeof(double) == sizeof(std::uint64_t));
+    std::uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    WriteUint32(out, static_cast<std::uint32_t>(bits));
+    WriteUint32(out, static_cast<std::uint32_t>(bits >> 32));
+}
+
+// Строка с длиной впереди
+inline void WriteString(std::string& out, std::string_view value) {
+    WriteUint32(out, static_cast<std::uint32_t>(value.size()));
+    out.append(value);
+}
+
+// Читает данные, записанные функциями Write*, с начала буфера. Буфер не
+// копируется. Нехватка данных - BinaryFormatError
+class BinaryReader {
+public:
+    explicit BinaryReader(std::string_view data)
+        : data_(data) {}
+
+    std::uint8_t ReadUint8() {
+        return static_cast<std::uint8_t>(Take(1)[0]);
+    }
+
+    std::uint32_t ReadUint32() {
+        const std::string_view bytes = Take(4);
+        std::uint32_t value = 0;
+        for (int i = 3; i >= 0; --i) {
+            value = (value << 8) | static_cast<std::uint8_t>(bytes[i]);
+        }
+        return value;
+    }
+
+    std::int32_t ReadInt32() {
+        return static_cast<std::int32_t>(ReadUint32());
+    }
+
+    double ReadDouble() {
+        const std::uint64_t low = ReadUint32();
+        const std::uint64_t bits = low | (static_cast<std::uint64_t>(ReadUint32()) << 32);
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    // Строка, записанная WriteString; указывает в буфер
+    std::string_view ReadString() {
+        return Take(ReadUint32());
+    }
+
+    // Следующие size байт; указывают в буфер
+    std::string_view Take(size_t size) {
+        if (size > data_.size()) {
+            throw BinaryFormatError("Unexpected end of data");
+        }
+        const std::string_view result = data_.substr(0, size);
+        data_.remove_prefix(size);
+        return result;
+    }
+
+    bool AtEnd() const {
+        return data_.empty();
+    }
+
+    // Число ещё не прочитанных байт
+    size_t GetRemainingSize() const {
+        return data_.size();
+    }
+
+private:
+    std::string_view data_;
+};
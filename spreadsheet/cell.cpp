@@ -1,26 +1,109 @@
 #include "cell.h"
 #include "sheet.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cstring>
+#include <mutex>
+#include <numeric>
 #include <optional>
-#include <queue>
-#include <stack>
 #include <stdexcept>
+#include <thread>
 #include <utility>
 #include <variant>
 
 using std::string;
 
+namespace {
+
+// ошибки формул в столбцовом хранилище (см. Cell::ValueTag)
+Cell::ValueTag TagFromError(FormulaError error) {
+    switch (error.GetCategory()) {
+        case FormulaError::Category::Ref:
+            return Cell::ValueTag::REF_ERROR;
+        case FormulaError::Category::Value:
+            return Cell::ValueTag::VALUE_ERROR;
+        default:
+            return Cell::ValueTag::ARITHMETIC_ERROR;
+    }
+}
+
+FormulaError ErrorFromTag(Cell::ValueTag tag) {
+    switch (tag) {
+        case Cell::ValueTag::REF_ERROR:
+            return FormulaError::Category::Ref;
+        case Cell::ValueTag::VALUE_ERROR:
+            return FormulaError::Category::Value;
+        default:
+            return FormulaError::Category::Arithmetic;
+    }
+}
+
+// Значение формулы одним 64-битным словом, чтобы его можно было хранить в
+// атомарной переменной: число - своими битами, ошибка - сигнальным NaN с
+// видом значения (Cell::ValueTag) в младших битах. Вычисления сигнальных
+// NaN не дают, так что с числами такие слова не путаются
+constexpr uint64_t PACKED_ERROR = 0x7ff4'0000'0000'0000;
+constexpr uint64_t PACKED_TAG_MASK = 0xff;
+constexpr uint64_t PACKED_NONE = PACKED_ERROR | 0x100;  // значения ещё нет
+
+uint64_t PackValue(const FormulaInterface::Value& value) {
+    if (const double* number = std::get_if<double>(&value)) {
+        uint64_t bits;
+        std::memcpy(&bits, number, sizeof(bits));
+        return bits;
+    }
+    return PACKED_ERROR | static_cast<uint64_t>(TagFromError(std::get<FormulaError>(value)));
+}
+
+std::optional<FormulaInterface::Value> UnpackValue(uint64_t bits) {
+    if (bits == PACKED_NONE) {
+        return std::nullopt;
+    }
+    if ((bits & ~PACKED_TAG_MASK) == PACKED_ERROR) {
+        return ErrorFromTag(static_cast<Cell::ValueTag>(bits & PACKED_TAG_MASK));
+    }
+    double number;
+    std::memcpy(&number, &bits, sizeof(number));
+    return number;
+}
+
+}  // namespace
+
 // ================= Impl =================
 
 class Cell::Impl {
 public:
     virtual ~Impl() = default;
     virtual CellInterface::Value GetValue() const = 0;
-    virtual std::string GetText() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;        
-    virtual void InvalidateCache() {}    // Для формульных ячеек — сброс кэша; по умолчанию ничего
+    virtual FormulaInterface::Value GetNumericValue() const = 0;
+    virtual const std::string& GetText() const = 0;
+    virtual const std::vector<Position>& GetReferencedCells() const {
+        static const std::vector<Position> none;
+        return none;
+    }        
+    // Диапазоны из аргументов функций формулы
+    virtual const std::vector<Range>& GetSourceRanges() const {
+        static const std::vector<Range> none;
+        return none;
+    }
+    // Для формульных ячеек — сброс кэша; по умолчанию ничего.
+    // Возвращает true, если было что сбрасывать
+    virtual bool InvalidateCache() { return false; }
+    // Нужно ли пересчитать значение (есть ли устаревший кэш)
+    virtual bool IsDirty() const { return false; }
+    virtual bool IsEmpty() const { return false; }
+    virtual const FormulaInterface* GetFormula() const { return nullptr; }
+    // Память содержимого в куче вместе с самим объектом (см. Sheet::GetStats)
+    virtual size_t GetHeapBytes() const = 0;
+    // Значение, вычисленное последним, даже если оно устарело. Читается без
+    // блокировок, в том числе пока формулу вычисляет другой поток
+    virtual std::optional<CellInterface::Value> GetLastValue() const { return GetValue(); }
+    // Ячейка подписалась на источники содержимого (sources - её рёбра к ним)
+    // или отписалась от них (nullptr)
+    virtual void BindSources(const SmallVector<Edge, 2>* /* sources */) {}
 };
 
 
@@ -32,12 +115,21 @@ public:
         return 0.0;
     }
 
-    std::string GetText() const override { 
-        return std::string{}; 
+    FormulaInterface::Value GetNumericValue() const override {
+        return 0.0;
+    }
+
+    const std::string& GetText() const override { 
+        static const std::string empty;
+        return empty; 
+    }
+
+    bool IsEmpty() const override {
+        return true;
     }
 
-    std::vector<Position> GetReferencedCells() const override { 
-        return {}; 
+    size_t GetHeapBytes() const override {
+        return sizeof(*this);
     }
 };
 
@@ -46,25 +138,37 @@ public:
 
 class Cell::TextImpl : public Impl {
 public:
-    explicit TextImpl(std::string text) : text_(std::move(text)) {}
+    explicit TextImpl(std::string text)
+        : text_(std::move(text))
+        , number_(ParseCellNumber(GetUnescaped())) {}  // разбираем число один раз, при записи
 
     CellInterface::Value GetValue() const override {
-        if (!text_.empty() && text_[0] == ESCAPE_SIGN) {
-            return text_.substr(1); // снимаем экранирование
-        }
-        return text_;
+        return std::string(GetUnescaped());
+    }
+
+    FormulaInterface::Value GetNumericValue() const override {
+        return number_;
     }
 
-    std::string GetText() const override { 
+    const std::string& GetText() const override { 
         return text_; 
     }
 
-    std::vector<Position> GetReferencedCells() const override { 
-        return {}; 
+    size_t GetHeapBytes() const override {
+        return sizeof(*this) + StringHeapBytes(text_);
     }
 
 private:
+    std::string_view GetUnescaped() const {
+        std::string_view text = text_;
+        if (!text.empty() && text[0] == ESCAPE_SIGN) {
+            text.remove_prefix(1); // снимаем экранирование
+        }
+        return text;
+    }
+
     std::string text_;
+    FormulaInterface::Value number_;  // число, #VALUE! или #ARITHM!
 };
 
 
@@ -72,82 +176,288 @@ private:
 
 class Cell::FormulaImpl : public Impl {
 public:        
-    FormulaImpl(std::string expression, SheetInterface& sheet)
-        : formula_ptr_(ParseFormula(std::move(expression)))
-        , sheet_(sheet) {}
+    FormulaImpl(std::string expression, Sheet& sheet, Position pos)
+        : FormulaImpl(sheet.GetFormulaCache().Parse(std::move(expression), pos), sheet) {}
+
+    // cached - уже известное значение; тогда формула не вычисляется до
+    // первого изменения её источников
+    FormulaImpl(std::unique_ptr<FormulaInterface> formula, Sheet& sheet,
+                std::optional<FormulaInterface::Value> cached = std::nullopt)
+        : formula_ptr_(std::move(formula))
+        , text_(FORMULA_SIGN + formula_ptr_->GetExpression())  // Очищенная версия, печатается один раз
+        , ranges_(formula_ptr_->GetReferencedRanges())
+        , sheet_(sheet) {
+        if (cached) {
+            cache_ = *cached;
+            last_value_.store(PackValue(cache_), std::memory_order_relaxed);
+            cache_state_.store(CacheState::READY, std::memory_order_relaxed);
+        }
+    }
 
     CellInterface::Value GetValue() const override {    
-        if (!cache_.has_value()) {        	
-            auto eval_result = formula_ptr_->Evaluate(sheet_);
+        return ToCellValue(GetNumericValue());
+    }
+
+    std::optional<CellInterface::Value> GetLastValue() const override {
+        const auto value = UnpackValue(last_value_.load(std::memory_order_relaxed));
+        if (!value) {
+            return std::nullopt;
+        }
+        return ToCellValue(*value);
+    }
 
-            if (std::holds_alternative<double>(eval_result)) {           
-                cache_ = std::get<double>(eval_result);
-            } else {            
-                cache_ = std::get<FormulaError>(eval_result);
+    FormulaInterface::Value GetNumericValue() const override {
+        if (cache_state_.load(std::memory_order_acquire) == CacheState::STALE) {
+            // значения ячеек берём напрямую, минуя CellInterface::Value.
+            // Cell::RecalculateUpstream заранее вычисляет источники, так что
+            // здесь они уже в кэше и рекурсии нет
+            auto get_cell_value = [this](Position pos) -> FormulaInterface::Value {
+                const auto [tag, number] = sheet_.GetStoredValue(pos);
+                switch (tag) {
+                    case ValueTag::EMPTY:
+                        return 0.0;
+                    case ValueTag::NUMBER:
+                        return number;
+                    case ValueTag::DIRTY:
+                        return sheet_.GetConcreteCell(pos)->GetNumericValue();
+                    default:
+                        return ErrorFromTag(tag);
+                }
+            };
+            auto get_range_value = [this](const Range& range) {
+                return SummarizeRange(range);
+            };
+            if (!source_slots_.empty()) {
+                cache_ = formula_ptr_->Evaluate(FormulaInterface::IndexedCellValueGetter{&ReadSource, this},
+                                                get_range_value);
+            } else {
+                cache_ = formula_ptr_->Evaluate(get_cell_value, get_range_value);
             }
+            last_value_.store(PackValue(cache_), std::memory_order_relaxed);
+            // публикуем значение: прочитавший READY с acquire видит cache_
+            cache_state_.store(CacheState::READY, std::memory_order_release);
         }
-        return *cache_;
+        return cache_;
     }
 
-    std::string GetText() const override {
-        return FORMULA_SIGN + formula_ptr_->GetExpression();  // Очищенная версия	
+    bool IsDirty() const override {
+        return cache_state_.load(std::memory_order_acquire) == CacheState::STALE;
     }
 
-    std::vector<Position> GetReferencedCells() const override {
+    const std::string& GetText() const override {
+        return text_;
+    }
+
+    const std::vector<Position>& GetReferencedCells() const override {
         return formula_ptr_->GetReferencedCells();	
     }
 
-    void InvalidateCache() override { // только reset собственного кэша
-        cache_.reset();
+    const std::vector<Range>& GetSourceRanges() const override {
+        return ranges_;
+    }
+
+    const FormulaInterface* GetFormula() const override {
+        return formula_ptr_.get();
+    }
+
+    // разобранное выражение сюда не входит: оно может быть общим
+    size_t GetHeapBytes() const override {
+        return sizeof(*this) + StringHeapBytes(text_) + VectorHeapBytes(ranges_)
+               + VectorHeapBytes(source_slots_);
+    }
+
+    void BindSources(const SmallVector<Edge, 2>* sources) override {
+        // Рёбра идут в порядке GetReferencedCells(), так что номер ссылки -
+        // номер ребра. Запоминаем слоты источников в столбцовом хранилище:
+        // чтение ссылки - два указателя, без поиска тайла и без обращения к
+        // самой ячейке-источнику
+        source_slots_.clear();
+        if (!sources || sources->size() != GetReferencedCells().size()) {
+            return;
+        }
+        source_slots_.reserve(sources->size());
+        for (const Edge& edge : *sources) {
+            source_slots_.push_back({edge.cell->value_slot_, edge.cell->tag_slot_});
+        }
+    }
+
+    bool InvalidateCache() override { // только reset собственного кэша
+        return cache_state_.exchange(CacheState::STALE, std::memory_order_relaxed) == CacheState::READY;
     }
 
 private:
+    enum class CacheState : uint8_t {
+        STALE,
+        READY,
+    };
+
+    struct SourceSlot {
+        const double* value;
+        const ValueTag* tag;
+    };
+
+    // значение index-го источника формулы context прямо из его слота
+    static FormulaInterface::Value ReadSource(const void* context, size_t index, Position pos) {
+        const FormulaImpl& self = *static_cast<const FormulaImpl*>(context);
+        const SourceSlot& slot = self.source_slots_[index];
+        switch (*slot.tag) {
+            case ValueTag::EMPTY:
+                return 0.0;
+            case ValueTag::NUMBER:
+                return *slot.value;
+            case ValueTag::DIRTY:
+                return self.sheet_.GetConcreteCell(pos)->GetNumericValue();
+            default:
+                return ErrorFromTag(*slot.tag);
+        }
+    }
+
+    static CellInterface::Value ToCellValue(const FormulaInterface::Value& value) {
+        if (std::holds_alternative<double>(value)) {
+            return std::get<double>(value);
+        }
+        return std::get<FormulaError>(value);
+    }
+
+    FormulaAST::RangeResult SummarizeRange(const Range& range) const {
+        // Диапазон читается из столбцового хранилища отрезками столбцов.
+        // Сплошь числовой отрезок сводится прямо на месте одним векторизуемым
+        // циклом (RangeSummary::Add); из остальных числа копятся в буфере
+        constexpr size_t BATCH = 64;
+        double batch[BATCH];
+        size_t batch_size = 0;
+        RangeSummary summary;
+        std::optional<FormulaError> error;
+
+        auto add = [&](double number) {
+            batch[batch_size++] = number;
+            if (batch_size == BATCH) {
+                summary.Add(batch, batch_size);
+                batch_size = 0;
+            }
+        };
+
+        sheet_.ForEachValueRun(range, [&](Position first, const double* values, const ValueTag* tags, size_t size) {
+            if (error) {
+                return;
+            }
+            if (std::all_of(tags, tags + size, [](ValueTag tag) { return tag == ValueTag::NUMBER; })) {
+                summary.Add(values, size);
+                return;
+            }
+            for (size_t i = 0; i < size && !error; ++i) {
+                switch (tags[i]) {
+                    case ValueTag::EMPTY:
+                        break;
+                    case ValueTag::NUMBER:
+                        add(values[i]);
+                        break;
+                    case ValueTag::DIRTY: {
+                        const Position pos{first.row + static_cast<int>(i), first.col};
+                        auto value = sheet_.GetConcreteCell(pos)->GetNumericValue();
+                        if (const auto* cell_error = std::get_if<FormulaError>(&value)) {
+                            error = *cell_error;
+                        } else {
+                            add(std::get<double>(value));
+                        }
+                        break;
+                    }
+                    default:
+                        error = ErrorFromTag(tags[i]);
+                }
+            }
+        });
+
+        if (error) {
+            return *error;
+        }
+        summary.Add(batch, batch_size);
+        return summary;
+    }
+
     std::unique_ptr<FormulaInterface> formula_ptr_;
-    SheetInterface& sheet_;
-    mutable std::optional<CellInterface::Value> cache_; 
+    std::string text_;
+    std::vector<Range> ranges_;
+    Sheet& sheet_;
+    std::vector<SourceSlot> source_slots_;  // см. BindSources
+
+    // Кэш значения. Готовый кэш читается без блокировок; записывает его один
+    // поток (под Sheet::GetRecalculationMutex или в RecalculateAll), а
+    // сбрасывает только писатель листа
+    mutable FormulaInterface::Value cache_;
+    // копия последнего вычисленного cache_ (см. PackValue): её читают без
+    // блокировок, пока cache_ перезаписывается
+    mutable std::atomic<uint64_t> last_value_{PACKED_NONE};
+    mutable std::atomic<CacheState> cache_state_{CacheState::STALE};
 };
 
 
 // ================= Cell =================
 
-Cell::Cell(Sheet& sheet)
+Cell::Cell(Sheet& sheet, Position pos)
     : sheet_(sheet)
-    , impl_(std::make_unique<EmptyImpl>()) {}
+    , pos_(pos)
+    , impl_(std::make_unique<EmptyImpl>())
+    , order_(sheet.TakeOrderAfterAll()) {
+    // ячейка внутри диапазона какой-то формулы - её источник и должна стоять
+    // в порядке раньше: у новой ячейки нет своих источников, ставим раньше всех
+    bool in_range = false;
+    ForEachDependent([&in_range](Cell*) {
+        in_range = true;
+    });
+    if (in_range) {
+        order_ = sheet.TakeOrderBeforeAll();
+    }
+}
 
 Cell::~Cell() = default;
 
+void Cell::BindValueSlot(double* value, ValueTag* tag) {
+    value_slot_ = value;
+    tag_slot_ = tag;
+    PublishValue();
+}
+
+void Cell::PublishValue() const {
+    if (!tag_slot_) {
+        return;
+    }
+    if (impl_->IsEmpty()) {
+        *tag_slot_ = ValueTag::EMPTY;
+        return;
+    }
+    if (impl_->IsDirty()) {
+        *tag_slot_ = ValueTag::DIRTY;
+        return;
+    }
+
+    const auto value = impl_->GetNumericValue();
+    if (const double* number = std::get_if<double>(&value)) {
+        *value_slot_ = *number;
+        *tag_slot_ = ValueTag::NUMBER;
+    } else {
+        *tag_slot_ = TagFromError(std::get<FormulaError>(value));
+    }
+}
+
 void Cell::Set(std::string text) {
     // если текст(значение в ячейке) не изменился - сразу выходим
-    if (text == Cell::GetText()) {
+    if (text == impl_->GetText()) {
         return;
     }
     
     // Сохраняем предыдущее состояние
-    auto old_impl = std::move(impl_);
-    std::vector<Position> new_refs;
+    std::unique_ptr<Impl> old_impl;
 
     try {
-        if (!text.empty() && text[0] == FORMULA_SIGN && text.size() > 1) {
-            // формула: парсим без '='
-            auto new_impl = std::make_unique<FormulaImpl>(text.substr(1), sheet_);
-            new_refs = new_impl->GetReferencedCells();
-
-            // проверка на цикличность (BFS через очередь)
-            if (CheckCircularDependency(new_refs)) {
-                throw CircularDependencyException("Circular dependency detected");
-            }
+        auto new_impl = MakeImpl(std::move(text), sheet_, pos_);
+        const std::vector<Position>& new_refs = new_impl->GetReferencedCells();
 
-            impl_ = std::move(new_impl);
-        } else if (!text.empty() && text[0] == ESCAPE_SIGN) {
-            // экранированный текст
-            impl_ = std::make_unique<TextImpl>(text);
-        } else if (!text.empty()) {
-            // обычный текст
-            impl_ = std::make_unique<TextImpl>(std::move(text));
-        } else {
-            // пусто
-            impl_ = std::make_unique<EmptyImpl>();
+        // проверка на цикличность (и поддержка топологического порядка)
+        if (CheckCircularDependency(new_refs, new_impl->GetSourceRanges())) {
+            throw CircularDependencyException("Circular dependency detected");
         }
+        old_impl = std::exchange(impl_, std::move(new_impl));
 
         // обновляем граф зависимостей (detach от старых, attach к новым)
         UpdateDependencies(new_refs);
@@ -157,11 +467,26 @@ void Cell::Set(std::string text) {
 
     } catch (...) {
         // откат
-        impl_ = std::move(old_impl);
+        if (old_impl) {
+            impl_ = std::move(old_impl);
+        }
         throw;
     }
 }
 
+std::unique_ptr<Cell::Impl> Cell::MakeImpl(std::string text, Sheet& sheet, Position pos) {
+    if (!text.empty() && text[0] == FORMULA_SIGN && text.size() > 1) {
+        // формула: парсим без '='
+        return std::make_unique<FormulaImpl>(text.substr(1), sheet, pos);
+    }
+    if (!text.empty()) {
+        // текст (в том числе экранированный)
+        return std::make_unique<TextImpl>(std::move(text));
+    }
+    // пусто
+    return std::make_unique<EmptyImpl>();
+}
+
 void Cell::Clear() {
     Set("");
 
@@ -173,14 +498,39 @@ void Cell::Clear() {
 }
 
 CellInterface::Value Cell::GetValue() const {
+    const bool dirty = impl_->IsDirty();
+    CountValueRead(dirty);
+    if (dirty) {
+        RecalculateUpstream();
+    }
     return impl_->GetValue();
 }
 
+FormulaInterface::Value Cell::GetNumericValue() const {
+    const bool dirty = impl_->IsDirty();
+    CountValueRead(dirty);
+    if (dirty) {
+        RecalculateUpstream();
+    }
+    return impl_->GetNumericValue();
+}
+
+void Cell::CountValueRead(bool dirty) const {
+    const SheetStats& stats = sheet_.GetStatsRecorder();
+    if (stats.IsEnabled() && impl_->GetFormula()) {
+        stats.Add(dirty ? SheetStats::Counter::CACHE_MISSES : SheetStats::Counter::CACHE_HITS);
+    }
+}
+
 std::string Cell::GetText() const {
     return impl_->GetText();
 }
 
-std::vector<Position> Cell::GetReferencedCells() const {
+const std::string& Cell::GetTextRef() const {
+    return impl_->GetText();
+}
+
+const std::vector<Position>& Cell::GetReferencedCells() const {
     return impl_->GetReferencedCells();
 }
 
@@ -188,49 +538,350 @@ bool Cell::IsReferenced() const {
     return !dependent_cells_.empty();
 }
 
+bool Cell::IsEmpty() const {
+    return impl_->IsEmpty();
+}
+
+bool Cell::IsDirty() const {
+    return impl_->IsDirty();
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+    return impl_->GetFormula();
+}
+
+size_t Cell::GetContentHeapBytes() const {
+    return impl_->GetHeapBytes();
+}
+
+void Cell::Recalculate() const {
+    if (impl_->IsDirty()) {
+        RecalculateUpstream();
+    }
+}
+
+Cell::KnownValue Cell::TryGetValue() const {
+    if (!impl_->IsDirty()) {
+        return {impl_->GetValue(), false};
+    }
+    return {impl_->GetLastValue(), true};
+}
+
+void Cell::RecalculateInParallel(std::vector<const Cell*> cells, size_t threads) {
+    if (cells.empty()) {
+        return;
+    }
+
+    // Раскладываем ячейки по уровням: ячейка стоит на уровень позже самого
+    // позднего из своих устаревших источников, поэтому ячейки одного уровня
+    // друг от друга не зависят. В топологическом порядке источники идут
+    // раньше, и уровень каждой ячейки считается за один проход.
+    auto by_order = [](const Cell* lhs, const Cell* rhs) {
+        return lhs->order_ < rhs->order_;
+    };
+    std::sort(cells.begin(), cells.end(), by_order);
+
+    std::vector<uint32_t> levels(cells.size());
+    uint32_t level_count = 1;
+    for (size_t i = 0; i < cells.size(); ++i) {
+        uint32_t level = 0;
+        cells[i]->ForEachSource([&](const Cell* src) {
+            if (!src->impl_->IsDirty()) {
+                return;
+            }
+            auto it = std::lower_bound(cells.begin(), cells.begin() + i, src, by_order);
+            assert(it != cells.begin() + i && *it == src);
+            level = std::max(level, levels[it - cells.begin()] + 1);
+        });
+        levels[i] = level;
+        level_count = std::max(level_count, level + 1);
+    }
+
+    // level_begin[l] - начало уровня l в расписании
+    std::vector<size_t> level_begin(level_count + 1, 0);
+    for (uint32_t level : levels) {
+        ++level_begin[level + 1];
+    }
+    std::partial_sum(level_begin.begin(), level_begin.end(), level_begin.begin());
+
+    std::vector<const Cell*> schedule(cells.size());
+    std::vector<size_t> next_slot(level_begin.begin(), level_begin.end() - 1);
+    for (size_t i = 0; i < cells.size(); ++i) {
+        schedule[next_slot[levels[i]]++] = cells[i];
+    }
+
+    // Потоки разбирают расписание кусками по CHUNK ячеек. Прежде чем начать
+    // уровень, поток ждёт, пока будут вычислены все ячейки предыдущих:
+    // completed увеличивается с release после записи кэшей и читается с
+    // acquire, так что записанные кэши источников видны вычисляющему потоку.
+    // Кусок, начатый раньше, никогда не ждёт более поздних, поэтому
+    // ожидание всегда заканчивается.
+    constexpr size_t CHUNK = 32;
+    const size_t total = schedule.size();
+    std::atomic<size_t> next_index{0};
+    std::atomic<size_t> completed{0};
+
+    auto work = [&] {
+        for (;;) {
+            size_t begin = next_index.fetch_add(CHUNK, std::memory_order_relaxed);
+            if (begin >= total) {
+                return;
+            }
+            const size_t end = std::min(begin + CHUNK, total);
+            while (begin < end) {
+                auto level = std::upper_bound(level_begin.begin(), level_begin.end(), begin) - 1;
+                const size_t level_end = std::min(end, *(level + 1));
+                while (completed.load(std::memory_order_acquire) < *level) {
+                    std::this_thread::yield();
+                }
+                for (size_t i = begin; i < level_end; ++i) {
+                    schedule[i]->impl_->GetNumericValue();
+                    schedule[i]->PublishValue();
+                }
+                completed.fetch_add(level_end - begin, std::memory_order_release);
+                begin = level_end;
+            }
+        }
+    };
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, (total + CHUNK - 1) / CHUNK);
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (size_t i = 1; i < threads; ++i) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    const SheetStats& stats = schedule.front()->sheet_.GetStatsRecorder();
+    stats.Add(SheetStats::Counter::EVALUATIONS, total);
+    stats.Record(SheetStats::Histogram::EVALUATIONS_PER_RECALCULATION, total);
+}
+
+
+// ---------- пакетная запись ----------
+
+Cell::Content::Content(std::unique_ptr<Impl> impl)
+    : impl_(std::move(impl)) {}
+
+Cell::Content::Content(Content&& other) noexcept = default;
+
+Cell::Content& Cell::Content::operator=(Content&& other) noexcept = default;
+
+Cell::Content::~Content() = default;
+
+Cell::Content Cell::Parse(std::string text, Sheet& sheet, Position pos) {
+    return Content(MakeImpl(std::move(text), sheet, pos));
+}
+
+Cell::Content Cell::FromFormula(std::unique_ptr<FormulaInterface> formula, Sheet& sheet,
+                                std::optional<FormulaInterface::Value> cached) {
+    return Content(std::make_unique<FormulaImpl>(std::move(formula), sheet, std::move(cached)));
+}
+
+Cell::Content Cell::Replace(Content content) {
+    UnsubscribeFromSources();
+    std::swap(impl_, content.impl_);
+    return content;
+}
+
+bool Cell::AttachSources() {
+    const std::vector<Position>& refs = impl_->GetReferencedCells();
+    if (CheckCircularDependency(refs, impl_->GetSourceRanges())) {
+        return false;
+    }
+    UpdateDependencies(refs);
+    return true;
+}
+
+void Cell::InvalidateCachesDownstream(Sheet& sheet, const std::vector<Cell*>& changed) {
+    InvalidateFrom(sheet, changed.data(), changed.data() + changed.size());
+}
+
+void Cell::PublishValues(const std::vector<Cell*>& changed) {
+    for (const Cell* cell : changed) {
+        cell->PublishValue();
+    }
+}
+
 
 // ---------- граф/помощники ----------
 
-bool Cell::CheckCircularDependency(const std::vector<Position>& new_refs) const {
-    // стартуем BFS от всех новых источников: если дойдём до this — цикл
-    std::queue<const Cell*> queue;
-    std::unordered_set<const Cell*> visited;
+template <typename Func>
+void Cell::ForEachSource(Func&& func) const {
+    for (const Edge& src : source_cells_) {
+        func(src.cell);
+    }
+    for (const Range& range : impl_->GetSourceRanges()) {
+        sheet_.ForEachCellInRange(range, [&func](Cell& cell) {
+            func(&cell);
+        });
+    }
+}
+
+template <typename Func>
+void Cell::ForEachDependent(Func&& func) const {
+    for (const Edge& d : dependent_cells_) {
+        func(d.cell);
+    }
+    sheet_.ForEachRangeDependent(pos_, func);
+}
+
+bool Cell::CheckCircularDependency(const std::vector<Position>& new_refs,
+                                   const std::vector<Range>& new_ranges) {
+    // Поддерживаем топологический порядок ячеек (алгоритм Пирса-Келли):
+    // у источника order_ меньше, чем у зависимой ячейки. Если все новые
+    // источники уже стоят раньше этой ячейки, цикла быть не может - это
+    // обычный случай, и он стоит O(число ссылок).
+    Sheet::TraversalBuffers& buffers = sheet_.GetTraversalBuffers();
+    // поздние источники собираем в buffers.backward: обратный обход
+    // стартует с них и заполнит этот же буфер заново
+    std::vector<Cell*>& late_sources = buffers.backward;
+    late_sources.clear();
 
+    int64_t upper = order_;
+    bool self_reference = false;
+    auto add_source = [&](Cell* src) {
+        if (src == this) {
+            self_reference = true;
+        } else if (src->order_ > order_) {
+            late_sources.push_back(src);
+            upper = std::max(upper, src->order_);
+        }
+    };
     for (const Position& pos : new_refs) {        
-        const Cell* c = sheet_.GetConcreteCell(pos);
-        if (!c) {
-            continue;
+        // отсутствующая ячейка ни на что не ссылается
+        if (Cell* src = sheet_.GetConcreteCell(pos)) {
+            add_source(src);
         }
-        if (c == this) {
+    }
+    for (const Range& range : new_ranges) {
+        if (range.Contains(pos_)) {
             return true;
         }
-        queue.push(c);
+        sheet_.ForEachCellInRange(range, [&add_source](Cell& src) {
+            add_source(&src);
+        });
+    }
+    if (self_reference) {
+        return true;
+    }
+    const SheetStats& stats = sheet_.GetStatsRecorder();
+    if (late_sources.empty()) {
+        stats.Record(SheetStats::Histogram::CYCLE_CHECK_VISITS, 0);
+        return false;
     }
 
-    while (!queue.empty()) {
-        const Cell* cur = queue.front();
-        queue.pop();
-        if (!visited.insert(cur).second) {
+    // Помечаем источники, стоящие позже этой ячейки...
+    const uint64_t source_epoch = sheet_.StartTraversal();
+    for (Cell* src : late_sources) {
+        src->visit_epoch_ = source_epoch;
+    }
+
+    // ...и идём вниз от этой ячейки, не заходя дальше самого позднего из них.
+    // Дойти до такого источника - значит найти цикл.
+    const uint64_t forward_epoch = sheet_.StartTraversal();
+    std::vector<Cell*>& forward = buffers.forward;
+    forward.clear();
+    buffers.stack.push_back(this);
+    while (!buffers.stack.empty()) {
+        Cell* cur = buffers.stack.back();
+        buffers.stack.pop_back();
+        if (cur->visit_epoch_ == forward_epoch) {
             continue;
         }
-        if (cur == this) {
+        cur->visit_epoch_ = forward_epoch;
+        forward.push_back(cur);
+
+        bool found_cycle = false;
+        cur->ForEachDependent([&](Cell* d) {
+            if (d->visit_epoch_ == source_epoch) {
+                found_cycle = true;
+            } else if (d->order_ <= upper && d->visit_epoch_ != forward_epoch) {
+                buffers.stack.push_back(d);
+            }
+        });
+        if (found_cycle) {
+            stats.Record(SheetStats::Histogram::CYCLE_CHECK_VISITS, forward.size());
             return true;
         }
-        // идём по ссылкам этой ячейки
-        for (const Cell* src : cur->source_cells_) {
-            queue.push(src);
+    }
+
+    // Цикла нет. Собираем источники поздних источников, стоящие после этой
+    // ячейки: вместе с ними эти источники должны переехать в порядке раньше
+    // найденных зависимых.
+    const uint64_t backward_epoch = sheet_.StartTraversal();
+    std::vector<Cell*>& backward = buffers.backward;
+    buffers.stack.assign(late_sources.begin(), late_sources.end());
+    backward.clear();
+    while (!buffers.stack.empty()) {
+        Cell* cur = buffers.stack.back();
+        buffers.stack.pop_back();
+        if (cur->visit_epoch_ == backward_epoch) {
+            continue;
         }
+        cur->visit_epoch_ = backward_epoch;
+        backward.push_back(cur);
+
+        cur->ForEachSource([&](Cell* src) {
+            if (src->order_ > order_ && src->visit_epoch_ != backward_epoch) {
+                buffers.stack.push_back(src);
+            }
+        });
+    }
+
+    // Раздаём освободившиеся номера: сначала поднятые источники, затем
+    // зависимые, каждую группу - в прежнем относительном порядке
+    auto by_order = [](const Cell* lhs, const Cell* rhs) {
+        return lhs->order_ < rhs->order_;
+    };
+    std::sort(backward.begin(), backward.end(), by_order);
+    std::sort(forward.begin(), forward.end(), by_order);
+
+    std::vector<int64_t>& orders = buffers.orders;
+    orders.clear();
+    for (const Cell* cell : backward) {
+        orders.push_back(cell->order_);
+    }
+    for (const Cell* cell : forward) {
+        orders.push_back(cell->order_);
+    }
+    std::sort(orders.begin(), orders.end());
+
+    size_t next = 0;
+    for (Cell* cell : backward) {
+        cell->order_ = orders[next++];
+    }
+    for (Cell* cell : forward) {
+        cell->order_ = orders[next++];
     }
+    stats.Record(SheetStats::Histogram::CYCLE_CHECK_VISITS, forward.size() + backward.size());
     return false;
 }
 
+void Cell::RemoveDependent(uint32_t index) {
+    // на место удаляемого ребра ставим последнее и чиним его парное ребро
+    dependent_cells_[index] = dependent_cells_.back();
+    dependent_cells_.pop_back();
+    if (index < dependent_cells_.size()) {
+        const Edge& moved = dependent_cells_[index];
+        moved.cell->source_cells_[moved.index].index = index;
+    }
+}
+
 void Cell::UnsubscribeFromSources() {
-    for (Cell* src : source_cells_) {
-        if (src) {
-            src->dependent_cells_.erase(this);
-        }
+    for (const Edge& src : source_cells_) {
+        src.cell->RemoveDependent(src.index);
     }
     source_cells_.clear();
+    impl_->BindSources(nullptr);
+    sheet_.RemoveRangeDependent(this);
 }
 
 void Cell::UpdateDependencies(const std::vector<Position>& new_refs) {
@@ -241,44 +892,181 @@ void Cell::UpdateDependencies(const std::vector<Position>& new_refs) {
     if (!new_refs.empty()) {
         for (const Position& pos : new_refs) {
             // получить/создать ячейку-источник
-            CellInterface* ci = sheet_.GetCell(pos);
-            if (!ci) {                
-                sheet_.SetCell(pos, "");
-                ci = sheet_.GetCell(pos);
+            Cell* src = sheet_.GetConcreteCell(pos);
+            if (!src) {
+                src = sheet_.CreateCell(pos);
+                // у новой пустой ячейки нет рёбер: ставим её раньше всех
+                src->order_ = sheet_.TakeOrderBeforeAll();
             }
-            if (!ci) continue;
+            if (src == this) continue;
+
+            // ссылки уже без повторов, так что ребро добавляется один раз
+            src->dependent_cells_.push_back({this, static_cast<uint32_t>(source_cells_.size())});
+            source_cells_.push_back({src, static_cast<uint32_t>(src->dependent_cells_.size() - 1)});
+        }
+    }
+
+    // на ячейки диапазонов рёбер нет, формула регистрируется в листе
+    if (!impl_->GetSourceRanges().empty()) {
+        sheet_.AddRangeDependent(this, impl_->GetSourceRanges());
+    }
+    impl_->BindSources(&source_cells_);
+}
+
+void Cell::RecalculateUpstream() const {
+    // Промах кэша обрабатывает один поток; остальные ждут здесь и затем
+    // находят значения уже готовыми
+    std::lock_guard guard(sheet_.GetRecalculationMutex());
+    if (!impl_->IsDirty()) {
+        return;
+    }
+
+    // Обход в глубину по источникам с явным стеком: ячейка вычисляется, когда
+    // снимается со стека во второй раз, то есть после всех своих устаревших
+    // источников. Глубина цепочки формул не зависит от размера стека потока.
+    const uint64_t epoch = sheet_.StartTraversal();
+    std::vector<Cell*>& stack = sheet_.GetTraversalBuffers().stack;
 
-            Cell* src = dynamic_cast<Cell*>(ci);
-            if (!src || src == this) continue;
+    uint64_t evaluated = 0;
+    stack.push_back(const_cast<Cell*>(this));
+    while (!stack.empty()) {
+        Cell* cur = stack.back();
+        if (cur->visit_epoch_ != epoch) {
+            // первый раз: кладём сверху устаревшие источники
+            cur->visit_epoch_ = epoch;
+            cur->ForEachSource([&](Cell* src) {
+                if (src->visit_epoch_ != epoch && src->impl_->IsDirty()) {
+                    stack.push_back(src);
+                }
+            });
+            continue;
+        }
 
-            source_cells_.insert(src);
-            src->dependent_cells_.insert(this);
+        // второй раз: источники уже посчитаны (ячейка могла попасть в стек
+        // дважды, тогда вторая копия ничего не делает)
+        stack.pop_back();
+        if (cur->impl_->IsDirty()) {
+            cur->impl_->GetNumericValue();
+            cur->PublishValue();
+            ++evaluated;
         }
     }
+
+    const SheetStats& stats = sheet_.GetStatsRecorder();
+    stats.Add(SheetStats::Counter::EVALUATIONS, evaluated);
+    stats.Record(SheetStats::Histogram::EVALUATIONS_PER_RECALCULATION, evaluated);
 }
 
 void Cell::InvalidateCacheDownstream() {
-    // Проходим вниз по зависимостям и сбрасываем кэш у всех формульных
-    std::stack<Cell*> st;
-    std::unordered_set<Cell*> visited;
+    Cell* self = this;
+    InvalidateFrom(sheet_, &self, &self + 1);
+}
+
+void Cell::InvalidateFrom(Sheet& sheet, Cell* const* first, Cell* const* last) {
+    if (sheet.GetRecalculationMode() == Sheet::RecalculationMode::EAGER) {
+        RecalculateFrom(sheet, first, last);
+        return;
+    }
 
-    st.push(this);
-    while (!st.empty()) {
-        Cell* cur = st.top();
-        st.pop();
+    // Проходим вниз по зависимостям и сбрасываем кэш у всех формульных.
+    // Значение формулы кэшируется только после того, как закэшированы её
+    // источники, поэтому у ячейки с уже сброшенным кэшем все зависимые тоже
+    // сброшены: на ней обход останавливается. Так каждая ячейка посещается
+    // не больше одного раза, и отдельное множество посещённых не нужно.
+    sheet.StartTraversal();
+    std::vector<Cell*>& stack = sheet.GetTraversalBuffers().stack;
 
-        if (!visited.insert(cur).second) continue;
+    // сами ячейки изменились — их зависимых сбрасываем в любом случае
+    for (Cell* const* it = first; it != last; ++it) {
+        (*it)->impl_->InvalidateCache();
+        (*it)->PublishValue();
+        sheet.NoteChanged((*it)->pos_);
+        (*it)->ForEachDependent([&stack](Cell* d) {
+            stack.push_back(d);
+        });
+    }
 
-        // Сброс кэша, если формула
-        if (cur->impl_) {
-            cur->impl_->InvalidateCache();
-        }
+    uint64_t invalidated = 0;
+    while (!stack.empty()) {
+        Cell* cur = stack.back();
+        stack.pop_back();
+
+        if (!cur->impl_->InvalidateCache()) continue;
+        cur->PublishValue();
+        // значение изменилось - снимки должны его увидеть
+        sheet.NoteChanged(cur->pos_);
+        ++invalidated;
 
         // дальше вниз
-        for (Cell* d : cur->dependent_cells_) {
-            st.push(d);
-        }
+        cur->ForEachDependent([&stack](Cell* d) {
+            stack.push_back(d);
+        });
     }
+    sheet.GetStatsRecorder().Record(SheetStats::Histogram::INVALIDATION_FAN_OUT, invalidated);
 }
 
 
+
+void Cell::RecalculateFrom(Sheet& sheet, Cell* const* first, Cell* const* last) {
+    // Ячейки пересчитываются в топологическом порядке: куча по order_ выдаёт
+    // ячейку только после всех её источников среди пересчитываемых. Новое
+    // значение сравнивается с тем, что лежало в столбцовом хранилище до
+    // пересчёта (его и видят формулы); если оно то же, зависимые не
+    // трогаются. Изменённые ячейки сравниваются так же, поэтому запись того
+    // же числа в другом виде до зависимых не доходит. Общие буферы обходов не
+    // используются: формула может прочитать источник, устаревший ещё до
+    // включения режима, и тогда его вычислит RecalculateUpstream.
+    auto later = [](const Cell* lhs, const Cell* rhs) {
+        return lhs->order_ > rhs->order_;
+    };
+    // число сравнивается побитово: -0 и 0 печатаются по-разному
+    auto published = [](const Cell* cell) {
+        const ValueTag tag = *cell->tag_slot_;
+        uint64_t bits = 0;
+        if (tag == ValueTag::NUMBER) {
+            std::memcpy(&bits, cell->value_slot_, sizeof(bits));
+        }
+        return std::pair(tag, bits);
+    };
+
+    std::vector<Cell*> heap(first, last);
+    for (const Cell* cell : heap) {
+        // текст изменился в любом случае
+        sheet.NoteChanged(cell->pos_);
+    }
+    std::make_heap(heap.begin(), heap.end(), later);
+
+    uint64_t evaluated = 0;
+    const Cell* previous = nullptr;
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        Cell* cur = heap.back();
+        heap.pop_back();
+        // номера выдаются по возрастанию, так что повторы одной ячейки идут подряд
+        if (cur == previous) {
+            continue;
+        }
+        previous = cur;
+
+        const auto before = published(cur);
+        cur->impl_->InvalidateCache();
+        if (cur->impl_->IsDirty()) {
+            cur->impl_->GetNumericValue();
+            ++evaluated;
+        }
+        cur->PublishValue();
+        if (published(cur) == before) {
+            continue;
+        }
+
+        sheet.NoteChanged(cur->pos_);
+        cur->ForEachDependent([&](Cell* d) {
+            heap.push_back(d);
+            std::push_heap(heap.begin(), heap.end(), later);
+        });
+    }
+
+    const SheetStats& stats = sheet.GetStatsRecorder();
+    stats.Add(SheetStats::Counter::EVALUATIONS, evaluated);
+    stats.Record(SheetStats::Histogram::EVALUATIONS_PER_RECALCULATION, evaluated);
+}
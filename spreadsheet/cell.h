@@ -2,18 +2,19 @@
 
 #include "common.h"
 #include "formula.h"
+#include "small_vector.h"
 
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <optional>
-#include <unordered_set>
 #include <vector>
 
 class Sheet;
 
 class Cell : public CellInterface {
 public:
-    explicit Cell(Sheet& sheet);
+    Cell(Sheet& sheet, Position pos);
     ~Cell();
 
     void Set(std::string text);
@@ -21,27 +22,173 @@ public:
 
     Value GetValue() const override;
     std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
+    const std::vector<Position>& GetReferencedCells() const override;
+
+    // То же, что GetText(), но без копирования строки
+    const std::string& GetTextRef() const;
+
+    // Значение ячейки так, как его видят ссылающиеся на неё формулы: число
+    // (текст уже разобран при записи) либо ошибка
+    FormulaInterface::Value GetNumericValue() const;
 
     // Есть ли на эту ячейку ссылки у других ячеек
     bool IsReferenced() const;
 
+    // Пуста ли ячейка (текст пустой); не строит текст ячейки
+    bool IsEmpty() const;
+
+    Position GetPosition() const {
+        return pos_;
+    }
+
+    // Нужно ли пересчитать значение (формула без актуального кэша)
+    bool IsDirty() const;
+
+    // Вычисляет значение, если кэш устарел; в отличие от GetValue, не
+    // считается чтением в Sheet::GetStats
+    void Recalculate() const;
+
+    // Последнее известное значение и устарело ли оно
+    struct KnownValue {
+        // std::nullopt, если формула ещё ни разу не вычислялась
+        std::optional<Value> value;
+        bool stale = false;
+    };
+
+    // Значение ячейки без ожидания: готовое - как GetValue, а у формулы с
+    // устаревшим кэшем - прежнее значение с пометкой stale. Ничего не
+    // вычисляет и не ждёт других потоков
+    KnownValue TryGetValue() const;
+
+    // Формула ячейки или nullptr, если в ячейке не формула
+    const FormulaInterface* GetFormula() const;
+
+    // Число рёбер к источникам и память списков рёбер в куче (см. Sheet::GetStats)
+    size_t GetSourceCount() const {
+        return source_cells_.size();
+    }
+    size_t GetEdgeHeapBytes() const {
+        return source_cells_.heap_bytes() + dependent_cells_.heap_bytes();
+    }
+    // Память текста и данных формулы, без разобранного выражения
+    size_t GetContentHeapBytes() const;
+
+    // Вычисляет формулы cells на threads потоках (см. Sheet::RecalculateAll).
+    // Вместе с каждой ячейкой в cells должны быть все её устаревшие источники
+    static void RecalculateInParallel(std::vector<const Cell*> cells, size_t threads);
+
+    // Вид значения в столбцовом хранилище тайла (см. CellStorage::Tile).
+    // Число лежит рядом, в массиве значений
+    enum class ValueTag : uint8_t {
+        EMPTY,
+        NUMBER,
+        DIRTY,  // формула без актуального кэша
+        REF_ERROR,
+        VALUE_ERROR,
+        ARITHMETIC_ERROR,
+    };
+
+    // Привязывает ячейку к её слоту в столбцовом хранилище; ячейка держит
+    // слот актуальным при каждом изменении значения
+    void BindValueSlot(double* value, ValueTag* tag);
+
 private:
     class Impl;
     class EmptyImpl;
     class TextImpl;
     class FormulaImpl;
 
+public:
+    // ---------- пакетная запись (см. Sheet::SetCells) ----------
+
+    // Разобранный текст ячейки, ещё не записанный в неё
+    class Content {
+    public:
+        Content(Content&& other) noexcept;
+        Content& operator=(Content&& other) noexcept;
+        ~Content();
+
+    private:
+        friend class Cell;
+        explicit Content(std::unique_ptr<Impl> impl);
+
+        std::unique_ptr<Impl> impl_;
+    };
+
+    // Разбирает текст для ячейки pos так же, как Set; ошибка в формуле -
+    // FormulaException
+    static Content Parse(std::string text, Sheet& sheet, Position pos);
+
+    // Содержимое-формула из готовой формулы, без разбора текста. cached -
+    // уже известное значение формулы (см. Sheet::Load)
+    static Content FromFormula(std::unique_ptr<FormulaInterface> formula, Sheet& sheet,
+                               std::optional<FormulaInterface::Value> cached = std::nullopt);
+
+    // Ставит новое содержимое, отписавшись от прежних источников. Циклы не
+    // проверяются, кэши не сбрасываются, в столбцовом хранилище остаётся
+    // прежнее значение. Возвращает прежнее содержимое
+    Content Replace(Content content);
+
+    // Подписывается на источники текущего содержимого. Возвращает false и
+    // ничего не меняет, если ссылки замкнули бы цикл
+    bool AttachSources();
+
+    // Сбрасывает кэши формул, зависящих от изменённых ячеек, за один обход
+    // (в режиме Sheet::RecalculationMode::EAGER - пересчитывает их)
+    static void InvalidateCachesDownstream(Sheet& sheet, const std::vector<Cell*>& changed);
+
+    // Записывает значения изменённых ячеек в столбцовое хранилище, не трогая
+    // зависимых: так можно, только если значения не изменились (см. Sheet::Load)
+    static void PublishValues(const std::vector<Cell*>& changed);
+
+private:
+    // Ребро графа зависимостей. Каждое ребро хранится у обеих ячеек; index -
+    // позиция парного ребра в списке ячейки cell, что позволяет удалять ребро
+    // за O(1), не просматривая список
+    struct Edge {
+        Cell* cell;
+        uint32_t index;
+    };
+
     Sheet& sheet_;
+    const Position pos_;
     std::unique_ptr<Impl> impl_;
 
-    // Граф зависимостей: источники и зависимые
-    std::unordered_set<Cell*> source_cells_;        // Ячейки, значения которых нужны для вычисления этой ячейки
-    std::unordered_set<Cell*> dependent_cells_;     // Ячейки, которые используют значение этой ячейки для своих вычислений
+    // Граф зависимостей: источники и зависимые. Списки непрерывные, первые
+    // элементы хранятся прямо в ячейке. Источники идут в порядке
+    // GetReferencedCells().
+    SmallVector<Edge, 2> source_cells_;        // Ячейки, значения которых нужны для вычисления этой ячейки
+    SmallVector<Edge, 2> dependent_cells_;     // Ячейки, которые используют значение этой ячейки для своих вычислений
+
+    // Слот ячейки в столбцовом хранилище тайла
+    double* value_slot_ = nullptr;
+    ValueTag* tag_slot_ = nullptr;
+
+    // Номер последнего обхода графа, посетившего ячейку (см. Sheet::StartTraversal)
+    mutable uint64_t visit_epoch_ = 0;
+
+    // Место ячейки в топологическом порядке: номер любого источника меньше
+    // номера зависимой ячейки
+    int64_t order_;
    
-    bool CheckCircularDependency(const std::vector<Position>& new_refs) const;
+    static std::unique_ptr<Impl> MakeImpl(std::string text, Sheet& sheet, Position pos);
+    static void InvalidateFrom(Sheet& sheet, Cell* const* first, Cell* const* last);
+    static void RecalculateFrom(Sheet& sheet, Cell* const* first, Cell* const* last);
+
+    // Источники и зависимые вместе с теми, что связаны через диапазоны
+    template <typename Func>
+    void ForEachSource(Func&& func) const;
+    template <typename Func>
+    void ForEachDependent(Func&& func) const;
+
+    bool CheckCircularDependency(const std::vector<Position>& new_refs,
+                                 const std::vector<Range>& new_ranges);
+    void RemoveDependent(uint32_t index);
     void UnsubscribeFromSources();
     void UpdateDependencies(const std::vector<Position>& new_refs);
+    void RecalculateUpstream() const;
+    void CountValueRead(bool dirty) const;
+    void PublishValue() const;
     void InvalidateCacheDownstream(); 
 };
 
@@ -0,0 +1,83 @@
+#include "cell_storage.h"
+
+#include <utility>
+
+Cell* CellStorage::Get(Position pos) const {
+    auto it = tiles_.find(TileKey(pos));
+    if (it == tiles_.end()) {
+        return nullptr;
+    }
+    return it->second->cells[IndexInTile(pos)];
+}
+
+CellStorage::~CellStorage() {
+    for (auto& [key, tile] : tiles_) {
+        for (Cell* cell : tile->cells) {
+            if (cell) {
+                pool_.Destroy(cell);
+            }
+        }
+    }
+}
+
+Cell* CellStorage::Put(Position pos, Cell* cell) {
+    auto& tile = tiles_[TileKey(pos)];
+    if (!tile) {
+        tile = std::make_unique<Tile>();
+    }
+
+    auto& slot = tile->cells[IndexInTile(pos)];
+    if (!slot) {
+        ++tile->count;
+        ++cell_count_;
+    } else {
+        pool_.Destroy(slot);
+    }
+    slot = cell;
+
+    auto& column = tile->columns[pos.col & TILE_MASK];
+    if (!column) {
+        column = std::make_unique<ValueColumn>();
+        ++tile->column_count;
+    }
+    const int index = pos.row & TILE_MASK;
+    slot->BindValueSlot(&column->values[index], &column->tags[index]);
+    return slot;
+}
+
+void CellStorage::Erase(Position pos) {
+    auto it = tiles_.find(TileKey(pos));
+    if (it == tiles_.end()) {
+        return;
+    }
+
+    auto& slot = it->second->cells[IndexInTile(pos)];
+    if (!slot) {
+        return;
+    }
+    pool_.Destroy(std::exchange(slot, nullptr));
+    it->second->columns[pos.col & TILE_MASK]->tags[pos.row & TILE_MASK] = Cell::ValueTag::EMPTY;
+    --cell_count_;
+
+    if (--it->second->count == 0) {
+        tiles_.erase(it);
+    }
+}
+
+CellStorage::StoredValue CellStorage::GetValue(Position pos) const {
+    auto it = tiles_.find(TileKey(pos));
+    if (it == tiles_.end()) {
+        return {Cell::ValueTag::EMPTY, 0.0};
+    }
+    const ValueColumn* column = it->second->columns[pos.col & TILE_MASK].get();
+    if (!column) {
+        return {Cell::ValueTag::EMPTY, 0.0};
+    }
+    const int index = pos.row & TILE_MASK;
+    return {column->tags[index], column->values[index]};
+}
+
+const CellStorage::Tile* CellStorage::FindTile(int tile_row, int tile_col) const {
+    auto it = tiles_.find(TileKey(tile_row, tile_col));
+    return it == tiles_.end() ? nullptr : it->second.get();
+}
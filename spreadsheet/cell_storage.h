@@ -0,0 +1,181 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "object_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+// Разреженное хранилище ячеек листа.
+// Лист делится на квадратные тайлы TILE_SIZE x TILE_SIZE. Память выделяется
+// только под тайлы, в которых есть хотя бы одна ячейка, поэтому расход памяти
+// зависит от числа заполненных ячеек, а не от размеров листа. Доступ к ячейке -
+// один поиск тайла в хеш-таблице и индексация внутри тайла. Сами ячейки
+// живут в пуле хранилища: создание и удаление ячеек не обращается к куче
+// на каждую ячейку, а память всех ячеек освобождается блоками.
+class CellStorage {
+public:
+    static constexpr int TILE_SHIFT = 6;
+    static constexpr int TILE_SIZE = 1 << TILE_SHIFT;
+    static constexpr int TILE_MASK = TILE_SIZE - 1;
+    static constexpr int TILE_CELLS = TILE_SIZE * TILE_SIZE;
+    static constexpr int TILE_ROWS = Position::MAX_ROWS / TILE_SIZE;
+    static constexpr int TILE_COLS = Position::MAX_COLS / TILE_SIZE;
+
+    // Числа и виды значений (см. Cell::ValueTag) одного столбца тайла
+    struct ValueColumn {
+        std::array<double, TILE_SIZE> values{};
+        std::array<Cell::ValueTag, TILE_SIZE> tags{};
+    };
+
+    // Ячейки тайла хранятся подряд, построчно. Рядом - столбцовое хранилище
+    // их числовых значений: столбец тайла лежит в памяти подряд и читается
+    // без обращения к самим ячейкам. Столбец значений выделяется при
+    // появлении в нём первой ячейки, так что редко заполненный тайл не
+    // держит значения всех своих слотов
+    struct Tile {
+        std::array<Cell*, TILE_CELLS> cells{};
+        std::array<std::unique_ptr<ValueColumn>, TILE_SIZE> columns{};
+        int count = 0;          // число непустых слотов
+        int column_count = 0;   // число выделенных столбцов значений
+    };
+
+    // Значение из столбцового хранилища
+    struct StoredValue {
+        Cell::ValueTag tag;
+        double number;
+    };
+
+    // Возвращает ячейку или nullptr, если в позиции ничего нет.
+    // Позиция должна быть корректной.
+    Cell* Get(Position pos) const;
+
+    CellStorage() = default;
+    CellStorage(const CellStorage&) = delete;
+    CellStorage& operator=(const CellStorage&) = delete;
+    ~CellStorage();
+
+    // Создаёт ячейку в позиции (заменяя существующую) и возвращает её
+    template <typename... Args>
+    Cell* Emplace(Position pos, Args&&... args) {
+        return Put(pos, pool_.Create(std::forward<Args>(args)...));
+    }
+
+    // Удаляет ячейку; опустевший тайл освобождается
+    void Erase(Position pos);
+
+    // Возвращает тайл по его координатам или nullptr, если тайл пуст
+    const Tile* FindTile(int tile_row, int tile_col) const;
+
+    // Число хранимых ячеек
+    size_t GetCellCount() const {
+        return cell_count_;
+    }
+
+    // Память тайлов (вместе со столбцами значений) и пула ячеек, в байтах
+    size_t GetTileBytes() const {
+        size_t columns = 0;
+        for (const auto& [key, tile] : tiles_) {
+            columns += tile->column_count;
+        }
+        return tiles_.size() * sizeof(Tile) + columns * sizeof(ValueColumn);
+    }
+    size_t GetPoolBytes() const {
+        return pool_.GetAllocatedBytes();
+    }
+
+    // Значение ячейки; для отсутствующей - EMPTY
+    StoredValue GetValue(Position pos) const;
+
+    // Номер слота позиции внутри её тайла
+    static int IndexInTile(Position pos) {
+        return ((pos.row & TILE_MASK) << TILE_SHIFT) | (pos.col & TILE_MASK);
+    }
+
+    // Обходит все хранимые ячейки (в произвольном порядке)
+    template <typename Func>
+    void ForEach(Func&& func) const {
+        for (const auto& [key, tile] : tiles_) {
+            const Position origin{(key / TILE_COLS) << TILE_SHIFT, (key % TILE_COLS) << TILE_SHIFT};
+            for (int i = 0; i < TILE_CELLS; ++i) {
+                if (tile->cells[i]) {
+                    func(Position{origin.row + (i >> TILE_SHIFT), origin.col + (i & TILE_MASK)},
+                         *tile->cells[i]);
+                }
+            }
+        }
+    }
+
+    // Обходит хранимые ячейки диапазона тайл за тайлом: пустые тайлы
+    // пропускаются целиком, внутри тайла ячейки идут построчно
+    template <typename Func>
+    void ForEachInRange(const Range& range, Func&& func) const {
+        for (int tile_row = range.from.row >> TILE_SHIFT; tile_row <= range.to.row >> TILE_SHIFT; ++tile_row) {
+            const int row_begin = std::max(range.from.row, tile_row << TILE_SHIFT);
+            const int row_end = std::min(range.to.row, ((tile_row + 1) << TILE_SHIFT) - 1);
+            for (int tile_col = range.from.col >> TILE_SHIFT; tile_col <= range.to.col >> TILE_SHIFT; ++tile_col) {
+                const Tile* tile = FindTile(tile_row, tile_col);
+                if (!tile) {
+                    continue;
+                }
+                const int col_begin = std::max(range.from.col, tile_col << TILE_SHIFT);
+                const int col_end = std::min(range.to.col, ((tile_col + 1) << TILE_SHIFT) - 1);
+                for (int row = row_begin; row <= row_end; ++row) {
+                    for (int col = col_begin; col <= col_end; ++col) {
+                        if (const auto& cell = tile->cells[IndexInTile({row, col})]) {
+                            func(*cell);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Обходит значения диапазона отрезками столбцов внутри тайлов:
+    // func(первая позиция, числа, виды значений, длина отрезка).
+    // Отсутствующие тайлы и столбцы значений (в них нет ячеек) пропускаются
+    template <typename Func>
+    void ForEachValueRun(const Range& range, Func&& func) const {
+        for (int tile_col = range.from.col >> TILE_SHIFT; tile_col <= range.to.col >> TILE_SHIFT; ++tile_col) {
+            const int col_begin = std::max(range.from.col, tile_col << TILE_SHIFT);
+            const int col_end = std::min(range.to.col, ((tile_col + 1) << TILE_SHIFT) - 1);
+            for (int tile_row = range.from.row >> TILE_SHIFT; tile_row <= range.to.row >> TILE_SHIFT; ++tile_row) {
+                const Tile* tile = FindTile(tile_row, tile_col);
+                if (!tile) {
+                    continue;
+                }
+                const int row_begin = std::max(range.from.row, tile_row << TILE_SHIFT);
+                const int row_end = std::min(range.to.row, ((tile_row + 1) << TILE_SHIFT) - 1);
+                for (int col = col_begin; col <= col_end; ++col) {
+                    const ValueColumn* column = tile->columns[col & TILE_MASK].get();
+                    if (!column) {
+                        continue;
+                    }
+                    const int index = row_begin & TILE_MASK;
+                    func(Position{row_begin, col}, column->values.data() + index, column->tags.data() + index,
+                         static_cast<size_t>(row_end - row_begin + 1));
+                }
+            }
+        }
+    }
+
+private:
+    static int TileKey(int tile_row, int tile_col) {
+        return tile_row * TILE_COLS + tile_col;
+    }
+
+    static int TileKey(Position pos) {
+        return TileKey(pos.row >> TILE_SHIFT, pos.col >> TILE_SHIFT);
+    }
+
+    Cell* Put(Position pos, Cell* cell);
+
+    std::unordered_map<int, std::unique_ptr<Tile>> tiles_;
+    ObjectPool<Cell> pool_;
+    size_t cell_count_ = 0;
+};
@@ -33,6 +33,25 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольный диапазон ячеек вместе с границами: from - левый верхний угол,
+// to - правый нижний. Записывается как "A1:B3".
+struct Range {
+    Position from;
+    Position to;
+
+    bool operator==(Range rhs) const;
+    bool operator<(Range rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+
+    // Углы можно указывать в любом порядке: "B3:A1" - то же, что "A1:B3"
+    static Range FromString(std::string_view str);
+
+    static const Range NONE;
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -76,6 +95,13 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Исключение, выбрасываемое при загрузке сохранённого листа, если данные
+// повреждены или записаны в неизвестном формате
+class BinaryFormatError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
 class CellInterface {
 public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
@@ -95,8 +121,9 @@ public:
 
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек. В случае текстовой ячейки список пуст.
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    // ячеек. В случае текстовой ячейки список пуст. Список хранится в ячейке
+    // и действителен, пока её содержимое не изменится.
+    virtual const std::vector<Position>& GetReferencedCells() const = 0;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
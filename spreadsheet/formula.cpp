@@ -5,7 +5,12 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <charconv>
+#include <cmath>
+#include <iterator>
+#include <limits>
 #include <sstream>
+#include <system_error>
 
 using namespace std::literals;
 
@@ -42,89 +47,240 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
 
 
 namespace {
+std::shared_ptr<const FormulaAST> ParseSharedAST(const std::string& expression) try {
+    return std::make_shared<const FormulaAST>(ParseFormulaAST(expression));
+} catch (const FormulaException&) {
+    throw;
+} catch (const std::exception& e) {
+    throw FormulaException("Formula parsing error: "s + e.what());
+}
+
+// Формула - разобранное выражение, возможно общее с другими формулами, и
+// сдвиг всех ссылок относительно него (см. FormulaCache)
 class Formula : public FormulaInterface {
 public:
-    explicit Formula(std::string expression) try : ast_(ParseFormulaAST(expression)) {
-    } catch (const FormulaException&) {
-        throw;
-    } catch (const std::exception& e) {
-        throw FormulaException("Formula parsing error: "s + e.what());
-    } 
+    Formula(std::shared_ptr<const FormulaAST> ast, Position offset)
+        : ast_(std::move(ast))
+        , offset_(offset) {
+        if (offset_ == Position{0, 0}) {
+            return;
+        }
+        // сдвиг не меняет порядка, список остаётся отсортированным
+        cells_.reserve(ast_->GetReferencedCells().size());
+        for (Position cell : ast_->GetReferencedCells()) {
+            cells_.push_back(ShiftPosition(cell, offset_));
+        }
+    }
+
+    Value Evaluate(const CellValueGetter& get_cell_value,
+                   const RangeValueGetter& get_range_value) const override {
+        return ast_->Execute(get_cell_value, get_range_value, offset_);
+    }
+
+    Value Evaluate(const IndexedCellValueGetter& get_cell_value,
+                   const RangeValueGetter& get_range_value) const override {
+        return ast_->Execute(get_cell_value, get_range_value, offset_);
+    }
 
     Value Evaluate(const SheetInterface& sheet) const override {
-        auto get_cell_value = [&sheet](Position pos) -> double {
+        auto get_cell_value = [&sheet](Position pos) -> Value {
             const CellInterface* cell = sheet.GetCell(pos);
             if (!cell) {
                 // ячейка отсутствует => трактуется как 0
                 return 0.0;
             }
-            auto val = cell->GetValue();
-
-            // Варианты: std::string, double, FormulaError
-            if (std::holds_alternative<double>(val)) {
-                return std::get<double>(val);
-            }
-
-            if (std::holds_alternative<FormulaError>(val)) {
-                throw std::get<FormulaError>(val);
-            }
+            return ToNumber(cell->GetValue());
+        };
 
-            if (std::holds_alternative<std::string>(val)) {
-                const std::string& s = std::get<std::string>(val);
-                if (s.empty()) {
-                    // пустая строка трактуется как 0
-                    return 0.0;
-                }
-                // пытаемся конвертировать строку в число
-                try {
-                    size_t idx = 0;
-                    double d = std::stod(s, &idx);
-                    if (idx == s.size()) {
-                        return d;
-                    } else {
-                        // строка содержит нечисловые символы
-                        throw FormulaError(FormulaError::Category::Value);
+        auto get_range_value = [&sheet](const Range& range) -> FormulaAST::RangeResult {
+            // за печатной областью непустых ячеек нет
+            const Size size = sheet.GetPrintableSize();
+            RangeSummary summary;
+            for (int row = range.from.row; row <= std::min(range.to.row, size.rows - 1); ++row) {
+                for (int col = range.from.col; col <= std::min(range.to.col, size.cols - 1); ++col) {
+                    const CellInterface* cell = sheet.GetCell({row, col});
+                    if (!cell || cell->GetText().empty()) {
+                        continue;
+                    }
+                    auto value = ToNumber(cell->GetValue());
+                    if (const auto* error = std::get_if<FormulaError>(&value)) {
+                        return *error;
                     }
-                } catch (const std::invalid_argument&) {
-                    throw FormulaError(FormulaError::Category::Value);
-                } catch (const std::out_of_range&) {
-                    throw FormulaError(FormulaError::Category::Arithmetic);
+                    summary.Add(std::get<double>(value));
                 }
             }
-
-            // По умолчанию (на всякий случай)
-            return 0.0;
+            return summary;
         };
-        
-        try {
-            return ast_.Execute(get_cell_value);
-        } catch (const FormulaError& e) {
-            return e;
-        }
+
+        return ast_->Execute(get_cell_value, get_range_value, offset_);
     }
 
     std::string GetExpression() const override {
         std::ostringstream out;
-        ast_.PrintFormula(out);
+        ast_->PrintFormula(out, offset_);
         return out.str();
     }
 
-    std::vector<Position> GetReferencedCells() const override {
-        std::vector<Position> result(ast_.GetReferencedCells().begin(), ast_.GetReferencedCells().end());
+    const std::vector<Position>& GetReferencedCells() const override {
+        return offset_ == Position{0, 0} ? ast_->GetReferencedCells() : cells_;
+    }
+
+    std::vector<Range> GetReferencedRanges() const override {
+        std::vector<Range> result;
+        result.reserve(ast_->GetReferencedRanges().size());
+        for (const Range& range : ast_->GetReferencedRanges()) {
+            result.push_back(ShiftRange(range, offset_));
+        }
         std::sort(result.begin(), result.end());
         result.erase(std::unique(result.begin(), result.end()), result.end());
         return result;
     }
 
+    const std::shared_ptr<const FormulaAST>& GetAST() const override {
+        return ast_;
+    }
+
+    Position GetOffset() const override {
+        return offset_;
+    }
+
 private:
-    FormulaAST ast_;
+    // Значение ячейки так, как его видит формула
+    static Value ToNumber(const CellInterface::Value& val) {
+        // Варианты: std::string, double, FormulaError
+        if (std::holds_alternative<double>(val)) {
+            return std::get<double>(val);
+        }
+
+        if (std::holds_alternative<FormulaError>(val)) {
+            return std::get<FormulaError>(val);
+        }
+
+        // текст: пустой - это 0, иначе пытаемся прочитать число
+        return ParseCellNumber(std::get<std::string>(val));
+    }
+
+    std::shared_ptr<const FormulaAST> ast_;
+    Position offset_;
+    std::vector<Position> cells_;  // сдвинутые ссылки, если сдвиг не нулевой
 };
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {   
     try {
-        return std::make_unique<Formula>(std::move(expression));
+        return std::make_unique<Formula>(ParseSharedAST(expression), Position{0, 0});
     } catch (FormulaException &fe) {
         throw fe;
     }
 }
+
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> ast, Position offset) {
+    return std::make_unique<Formula>(std::move(ast), offset);
+}
+
+std::unique_ptr<FormulaInterface> FormulaCache::Parse(std::string expression, Position pos) {
+    auto key = MakeRelativeFormulaKey(expression, pos);
+    if (!key) {
+        return ParseUncached(std::move(expression));
+    }
+
+    {
+        std::lock_guard guard(mutex_);
+        if (auto it = templates_.find(*key); it != templates_.end()) {
+            if (auto ast = it->second.ast.lock()) {
+                if (stats_) {
+                    stats_->Add(SheetStats::Counter::FORMULA_TEMPLATE_HITS);
+                }
+                const Position offset{pos.row - it->second.anchor.row, pos.col - it->second.anchor.col};
+                return std::make_unique<Formula>(std::move(ast), offset);
+            }
+        }
+    }
+
+    // разбор - без блокировки; если тот же шаблон тем временем разобрал другой
+    // поток, запись заменяется, а прежний шаблон живёт, пока им пользуются
+    std::shared_ptr<const FormulaAST> ast;
+    {
+        SheetStats::Timer timer(stats_, SheetStats::Counter::PARSE_NANOSECONDS);
+        ast = ParseSharedAST(expression);
+    }
+    if (stats_) {
+        stats_->Add(SheetStats::Counter::FORMULA_PARSES);
+    }
+    std::lock_guard guard(mutex_);
+    templates_[std::move(*key)] = {ast, pos};
+
+    // формулы, которые больше нигде не используются, вычищаются, когда их
+    // накапливается столько же, сколько было живых при прошлой чистке
+    if (templates_.size() >= cleanup_threshold_) {
+        for (auto it = templates_.begin(); it != templates_.end();) {
+            it = it->second.ast.expired() ? templates_.erase(it) : std::next(it);
+        }
+        cleanup_threshold_ = std::max(MIN_CLEANUP_THRESHOLD, templates_.size() * 2);
+    }
+    return std::make_unique<Formula>(std::move(ast), Position{0, 0});
+}
+
+size_t FormulaCache::GetMemoryBytes() const {
+    std::lock_guard guard(mutex_);
+    size_t bytes = HashMapBytes(templates_);
+    for (const auto& [key, entry] : templates_) {
+        bytes += StringHeapBytes(key);
+    }
+    return bytes;
+}
+
+std::unique_ptr<FormulaInterface> FormulaCache::ParseUncached(std::string expression) const {
+    SheetStats::Timer timer(stats_, SheetStats::Counter::PARSE_NANOSECONDS);
+    auto formula = ParseFormula(std::move(expression));
+    if (stats_) {
+        stats_->Add(SheetStats::Counter::FORMULA_PARSES);
+    }
+    return formula;
+}
+
+FormulaInterface::Value ParseCellNumber(std::string_view text) {
+    if (text.empty()) {
+        // пустая строка трактуется как 0
+        return 0.0;
+    }
+
+    // Тот же формат, что принимает std::stod: ведущие пробелы, необязательный
+    // знак, десятичная или шестнадцатеричная (0x...) запись
+    size_t start = 0;
+    while (start < text.size() && std::isspace(static_cast<unsigned char>(text[start]))) {
+        ++start;
+    }
+    std::string_view number = text.substr(start);
+
+    bool negative = false;
+    if (!number.empty() && (number[0] == '+' || number[0] == '-')) {
+        negative = number[0] == '-';
+        number.remove_prefix(1);
+    }
+
+    auto format = std::chars_format::general;
+    if (number.size() > 2 && number[0] == '0' && (number[1] == 'x' || number[1] == 'X')) {
+        format = std::chars_format::hex;
+        number.remove_prefix(2);
+    }
+
+    if (number.empty() || number[0] == '+' || number[0] == '-') {
+        return FormulaError(FormulaError::Category::Value);
+    }
+
+    double value = 0.0;
+    const char* last = number.data() + number.size();
+    auto [ptr, ec] = std::from_chars(number.data(), last, value, format);
+    // std::stod считает выходом за диапазон и субнормальные числа, а
+    // from_chars их возвращает
+    const bool subnormal = value != 0 && std::fabs(value) < std::numeric_limits<double>::min();
+    if (ec == std::errc::result_out_of_range || (ec == std::errc() && subnormal)) {
+        return FormulaError(FormulaError::Category::Arithmetic);
+    }
+    if (ec != std::errc() || ptr != last) {
+        // строка содержит нечисловые символы
+        return FormulaError(FormulaError::Category::Value);
+    }
+    return negative ? -value : value;
+}
@@ -3,8 +3,14 @@
 #include "common.h"
 
 #include "FormulaAST.h"
+#include "sheet_stats.h"
 
+#include <cstddef>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 
@@ -12,6 +18,10 @@
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Функции SUM, AVERAGE, MIN, MAX, COUNT от выражений и диапазонов:
+//   SUM(A1:A100, B2*2). Пустые ячейки диапазона пропускаются, остальные
+//   трактуются так же, как ячейки-переменные. AVERAGE без значений даёт
+//   ошибку #ARITHM!, MIN и MAX без значений - ноль.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -29,17 +39,90 @@ public:
     // любая.
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
 
+    // Функтор, возвращающий значение ячейки так, как его видят формулы:
+    // число либо ошибку
+    using CellValueGetter = FormulaAST::CellValueGetter;
+
+    // Функтор, сводящий непустые ячейки диапазона (сумма, минимум, максимум,
+    // количество) либо возвращающий ошибку одной из них
+    using RangeValueGetter = FormulaAST::RangeValueGetter;
+
+    // То же, но значения ячеек и диапазонов запрашиваются у переданных
+    // функторов. Позволяет таблице отдавать уже готовые числа, не строя
+    // CellInterface::Value, и сводить диапазоны, не перебирая пустые ячейки.
+    virtual Value Evaluate(const CellValueGetter& get_cell_value,
+                           const RangeValueGetter& get_range_value) const = 0;
+
+    // То же, но ячейки запрашиваются по номеру в GetReferencedCells(): таблица,
+    // заранее связавшая формулу с ячейками-источниками, читает их без поиска
+    using IndexedCellValueGetter = FormulaAST::IndexedCellValueGetter;
+    virtual Value Evaluate(const IndexedCellValueGetter& get_cell_value,
+                           const RangeValueGetter& get_range_value) const = 0;
+
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
     virtual std::string GetExpression() const = 0;
 
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    // ячеек. Список хранится в самой формуле, копии не создаются.
+    virtual const std::vector<Position>& GetReferencedCells() const = 0;
+
+    // Возвращает диапазоны из аргументов функций. Список отсортирован по
+    // возрастанию и не содержит повторов. Ячейки диапазонов в
+    // GetReferencedCells() не входят.
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
+
+    // Разобранное выражение, возможно общее с другими формулами, и сдвиг
+    // ссылок этой формулы относительно него (см. FormulaCache)
+    virtual const std::shared_ptr<const FormulaAST>& GetAST() const = 0;
+    virtual Position GetOffset() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
 
+// Формула из уже разобранного выражения, ссылки которого сдвинуты на offset.
+// Сдвинутые ссылки должны оставаться в пределах листа.
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> ast, Position offset);
+
+// Разобранные формулы, общие для ячеек листа. Формулы, совпадающие в
+// относительной записи (R1C1), - например, =B1*C1 в A1 и =B2*C2 в A2 -
+// разбираются один раз: повтор получает тот же разобранный шаблон и сдвиг
+// ссылок относительно ячейки, где шаблон был разобран впервые. Так память
+// растёт с числом различных формул, а не ячеек. Шаблон живёт, пока им
+// пользуется хотя бы одна формула.
+class FormulaCache {
+public:
+    // Разборы и найденные шаблоны считаются в stats, если он задан
+    explicit FormulaCache(const SheetStats* stats = nullptr)
+        : stats_(stats) {}
+
+    // То же, что ParseFormula, для формулы в ячейке pos. Потокобезопасен
+    std::unique_ptr<FormulaInterface> Parse(std::string expression, Position pos);
+
+    // Память таблицы шаблонов (сами выражения принадлежат формулам)
+    size_t GetMemoryBytes() const;
+
+private:
+    static constexpr size_t MIN_CLEANUP_THRESHOLD = 1024;
+
+    struct Template {
+        std::weak_ptr<const FormulaAST> ast;
+        Position anchor;
+    };
+
+    std::unique_ptr<FormulaInterface> ParseUncached(std::string expression) const;
+
+    const SheetStats* stats_;
+    mutable std::mutex mutex_;  // Parse можно вызывать из нескольких потоков
+    std::unordered_map<std::string, Template> templates_;
+    size_t cleanup_threshold_ = MIN_CLEANUP_THRESHOLD;
+};
+
+// Трактует текст ячейки как число (так его видят формулы): пустой текст - ноль,
+// текст, целиком являющийся числом, - это число, иначе ошибка #VALUE!. Если
+// число не помещается в double, возвращается #ARITHM!. Исключений не бросает.
+FormulaInterface::Value ParseCellNumber(std::string_view text);
+
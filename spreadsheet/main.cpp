@@ -1,7 +1,23 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
 #include <limits>
+#include <mutex>
+#include <random>
+#include <set>
+#include <shared_mutex>
+#include <thread>
 
+#include "binary_io.h"
 #include "common.h"
 #include "formula.h"
+#include "read_write_mutex.h"
+#include "sheet.h"
 #include "test_runner_p.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
@@ -190,6 +206,15 @@ void TestFormulaReferencedCells() {
     auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
     ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
     ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
+    // список хранится в формуле, а не строится при каждом вызове
+    ASSERT(&tricky->GetReferencedCells() == &tricky->GetReferencedCells());
+
+    auto repeated = ParseFormula("C3*A1-C3/A1");
+    ASSERT_EQUAL(repeated->GetReferencedCells(), (std::vector{"A1"_pos, "C3"_pos}));
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("C3"_pos, "6");
+    ASSERT_EQUAL(std::get<double>(repeated->Evaluate(*sheet)), 9.0);
 }
 
 void TestErrorValue() {
@@ -346,6 +371,1379 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestSparseFarCorner() {
+    auto sheet = CreateSheet();
+    const Position corner{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+
+    sheet->SetCell(corner, "far");
+    sheet->SetCell("A1"_pos, "near");
+    ASSERT_EQUAL(sheet->GetCell(corner)->GetText(), "far");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "near");
+    ASSERT(sheet->GetCell("B2"_pos) == nullptr);
+    ASSERT(sheet->GetCell(Position{Position::MAX_ROWS - 1, 0}) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+
+    sheet->ClearCell(corner);
+    ASSERT(sheet->GetCell(corner) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+}
+
+void TestPrintableSizeAfterClear() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "a");
+    sheet->SetCell("C5"_pos, "c");
+    sheet->SetCell("E2"_pos, "e");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 5}));
+
+    sheet->ClearCell("C5"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 5}));
+
+    sheet->SetCell("E2"_pos, "");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+
+    sheet->ClearCell("E2"_pos);
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestFastParserMatchesAntlr() {
+    struct Printed {
+        std::string tree;
+        std::string formula;
+        std::string cells;
+    };
+    auto print = [](const FormulaAST& ast) {
+        std::ostringstream tree, formula, cells;
+        ast.Print(tree);
+        ast.PrintFormula(formula);
+        ast.PrintCells(cells);
+        return Printed{tree.str(), formula.str(), cells.str()};
+    };
+    auto parseAntlr = [](const std::string& expr) {
+        std::istringstream in(expr);
+        return ParseFormulaAST(in);
+    };
+
+    const std::vector<std::string> valid = {
+        "1", " 42 ", ".5", "1.25", "3e2", "1.5E-3", "2e+10", "0.0",
+        "-1", "+1", "--A1", "-+-B2", "1+2*3", "(1+2)*3", "1-2-3", "1-(2-3)",
+        "8/4/2", "8/(4/2)", "-A1*2", "-(A1*2)", "+(1+2)/3", "A1+B2*C3",
+        "( ( (  1) ) )", "\t1\r\n+\n2", "ZZ99/(AA1-XFD16384)", "A1 + A2 + A1 + A3",
+    };
+    for (const auto& expr : valid) {
+        auto fast = TryParseFormulaASTFast(expr);
+        ASSERT(fast.has_value());
+        auto expected = print(parseAntlr(expr));
+        auto actual = print(*fast);
+        ASSERT_EQUAL(actual.tree, expected.tree);
+        ASSERT_EQUAL(actual.formula, expected.formula);
+        ASSERT_EQUAL(actual.cells, expected.cells);
+    }
+
+    const std::vector<std::string> invalid = {
+        "", "A2B", "3X", "A0++", "((1)", "2+4-", "1.", "1e", "1e+", "1 2", "A1B2",
+        "a1", "X0", "A123456", "XFE16384", "1e400", "()", "1+*2", "#", "1,5",
+    };
+    for (const auto& expr : invalid) {
+        ASSERT(!TryParseFormulaASTFast(expr).has_value());
+        bool antlr_failed = false;
+        try {
+            parseAntlr(expr);
+        } catch (const std::exception&) {
+            antlr_failed = true;
+        }
+        ASSERT(antlr_failed);
+    }
+}
+
+void TestFormulaDeepExpression() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+
+    // длинная левая цепочка и глубоко вложенная правая (стек глубже встроенного)
+    std::string left_chain = "A1";
+    std::string right_nested = "A1";
+    for (int i = 0; i < 200; ++i) {
+        left_chain += "+1";
+        right_nested = "1-(" + right_nested + ")";
+    }
+
+    auto evaluate = [&](const std::string& expr) {
+        return ParseFormula(expr)->Evaluate(*sheet);
+    };
+    ASSERT_EQUAL(std::get<double>(evaluate(left_chain)), 202);
+    ASSERT_EQUAL(std::get<double>(evaluate(right_nested)), 2);
+    ASSERT_EQUAL(std::get<FormulaError>(evaluate("1-(2-(3/(A1-2)))")),
+                 FormulaError(FormulaError::Category::Arithmetic));
+
+    // слишком глубокая вложенность отвергается при разборе, а не переполняет стек
+    const size_t too_deep = 100000;
+    const std::string minuses(too_deep, '-');
+    const std::string nested = std::string(too_deep, '(') + "1" + std::string(too_deep, ')');
+    for (const std::string& expr : {minuses + "1", nested, "SUM(" + nested + ")", ")" + nested}) {
+        try {
+            sheet->SetCell("B1"_pos, "=" + expr);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+}
+
+void TestParseCellNumber() {
+    auto number = [](std::string_view text) {
+        return std::get<double>(ParseCellNumber(text));
+    };
+    auto error = [](std::string_view text) {
+        return std::get<FormulaError>(ParseCellNumber(text)).GetCategory();
+    };
+
+    ASSERT_EQUAL(number(""), 0);
+    ASSERT_EQUAL(number("42"), 42);
+    ASSERT_EQUAL(number("-1.5e3"), -1500);
+    ASSERT_EQUAL(number("+.25"), 0.25);
+    ASSERT_EQUAL(number("  7"), 7);
+    ASSERT_EQUAL(number("0x1A"), 26);
+
+    ASSERT(error("3D") == FormulaError::Category::Value);
+    ASSERT(error("7 ") == FormulaError::Category::Value);
+    ASSERT(error("+-1") == FormulaError::Category::Value);
+    ASSERT(error(" ") == FormulaError::Category::Value);
+    ASSERT(error("1e400") == FormulaError::Category::Arithmetic);
+    // как и std::stod: субнормальные числа и исчезновение порядка - ошибка
+    ASSERT(error("1e-310") == FormulaError::Category::Arithmetic);
+    ASSERT(error("-4.9e-324") == FormulaError::Category::Arithmetic);
+    ASSERT(error("1e-400") == FormulaError::Category::Arithmetic);
+    ASSERT_EQUAL(number("2.2250738585072014e-308"), std::numeric_limits<double>::min());
+    ASSERT_EQUAL(number("0e-500"), 0);
+}
+
+void TestErrorPropagation() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=1/0");
+    sheet->SetCell("B1"_pos, "=A1+1");
+    sheet->SetCell("C1"_pos, "=B1*B1");
+    sheet->SetCell("D1"_pos, "text");
+    sheet->SetCell("E1"_pos, "=D1+C1");
+
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+    // первая по порядку вычисления ошибка побеждает
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+
+    sheet->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(9.0));
+}
+
+void TestFormulaReadsTextNumbers() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "'12");
+    sheet->SetCell("A2"_pos, "1e400");
+    sheet->SetCell("B1"_pos, "=A1*2");
+    sheet->SetCell("B2"_pos, "=A2");
+
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value("12"));
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(24.0));
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    sheet->SetCell("A1"_pos, "0.5");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0));
+}
+
+void TestDependencyGraphRewiring() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    for (int row = 0; row < 50; ++row) {
+        sheet->SetCell(Position{row, 1}, "=A1+" + std::to_string(row));
+    }
+
+    // часть зависимых переписываем и удаляем, оставшиеся должны видеть изменения A1
+    for (int row = 0; row < 50; row += 3) {
+        sheet->SetCell(Position{row, 1}, "=" + std::to_string(row));
+    }
+    for (int row = 1; row < 50; row += 3) {
+        sheet->ClearCell(Position{row, 1});
+    }
+    sheet->SetCell("A1"_pos, "10");
+
+    for (int row = 0; row < 50; ++row) {
+        const CellInterface* cell = sheet->GetCell(Position{row, 1});
+        if (row % 3 == 1) {
+            ASSERT(cell == nullptr);
+        } else {
+            double expected = row % 3 == 0 ? row : 10 + row;
+            ASSERT_EQUAL(cell->GetValue(), CellInterface::Value(expected));
+        }
+    }
+
+    // у A1 ещё есть зависимые, поэтому ячейка остаётся пустой, а не удаляется
+    sheet->ClearCell("A1"_pos);
+    ASSERT(sheet->GetCell("A1"_pos) != nullptr);
+    ASSERT_EQUAL(sheet->GetCell(Position{2, 1})->GetValue(), CellInterface::Value(2.0));
+}
+
+void TestCacheInvalidationChain() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("B1"_pos, "=A1+1");
+    sheet->SetCell("C1"_pos, "=B1+A1");
+    sheet->SetCell("D1"_pos, "=C1*B1");
+    auto value = [&](Position pos) {
+        return std::get<double>(sheet->GetCell(pos)->GetValue());
+    };
+
+    ASSERT_EQUAL(value("D1"_pos), 6);
+
+    // несколько правок подряд без чтения: вторая упирается в уже сброшенные кэши
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(value("B1"_pos), 4);
+
+    // B1 снова в кэше, C1 и D1 ещё нет
+    sheet->SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(value("D1"_pos), 45);
+    sheet->SetCell("B1"_pos, "=A1");
+    ASSERT_EQUAL(value("D1"_pos), 32);
+}
+
+// Случайные правки на небольшом поле. Обнаружение циклов сверяется с полным
+// перебором ссылок, значения формул - с прямым вычислением по значениям
+// источников.
+void CheckRandomEdits(SheetInterface& sheet, unsigned seed) {
+    constexpr int FIELD = 6;
+    std::mt19937 rng(seed);
+    auto randomPos = [&] {
+        return Position{static_cast<int>(rng() % FIELD), static_cast<int>(rng() % FIELD)};
+    };
+
+    auto reaches = [&](const std::vector<Position>& refs, Position target) {
+        std::vector<Position> stack = refs;
+        std::set<Position> visited;
+        while (!stack.empty()) {
+            Position cur = stack.back();
+            stack.pop_back();
+            if (cur == target) {
+                return true;
+            }
+            if (!visited.insert(cur).second) {
+                continue;
+            }
+            if (const CellInterface* cell = sheet.GetCell(cur)) {
+                for (Position ref : cell->GetReferencedCells()) {
+                    stack.push_back(ref);
+                }
+            }
+        }
+        return false;
+    };
+
+    for (int step = 0; step < 3000; ++step) {
+        const Position pos = randomPos();
+        const unsigned kind = rng() % 5;
+        if (kind == 0) {
+            sheet.ClearCell(pos);
+            continue;
+        }
+        if (kind == 1) {
+            sheet.SetCell(pos, std::to_string(rng() % 10));
+            continue;
+        }
+
+        std::vector<Position> refs(1 + rng() % 3);
+        std::string text = "=1";
+        for (Position& ref : refs) {
+            ref = randomPos();
+            text += "+" + ref.ToString();
+        }
+
+        bool cycle = false;
+        try {
+            sheet.SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+            cycle = true;
+        }
+        ASSERT_EQUAL(cycle, reaches(refs, pos));
+    }
+
+    for (int row = 0; row < FIELD; ++row) {
+        for (int col = 0; col < FIELD; ++col) {
+            const CellInterface* cell = sheet.GetCell({row, col});
+            if (!cell || cell->GetText().empty() || cell->GetText()[0] != FORMULA_SIGN) {
+                continue;
+            }
+            auto expected = ParseFormula(cell->GetText().substr(1))->Evaluate(sheet);
+            ASSERT_EQUAL(std::get<double>(cell->GetValue()), std::get<double>(expected));
+        }
+    }
+}
+
+void TestRandomEditsStayConsistent() {
+    for (unsigned seed = 1; seed <= 5; ++seed) {
+        auto sheet = CreateSheet();
+        CheckRandomEdits(*sheet, seed);
+    }
+}
+
+void TestDeepChainRecalculation() {
+    // цепочка длиннее, чем позволил бы рекурсивный пересчёт на стеке потока
+    // (змейкой по столбцам, так как число строк ограничено)
+    constexpr int LENGTH = 100000;
+    auto at = [](int i) {
+        return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+    };
+    auto sheet = CreateSheet();
+    sheet->SetCell(at(0), "1");
+    for (int i = 1; i < LENGTH; ++i) {
+        sheet->SetCell(at(i), "=" + at(i - 1).ToString() + "+1");
+    }
+
+    const Position last = at(LENGTH - 1);
+    ASSERT_EQUAL(sheet->GetCell(last)->GetValue(), CellInterface::Value(double(LENGTH)));
+
+    sheet->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet->GetCell(last)->GetValue(), CellInterface::Value(double(LENGTH + 1)));
+}
+
+void TestSetCellsBatch() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1");
+    sheet.SetCell("B1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    // по одной эти записи дали бы цикл A1 -> B1 -> A1, итоговый лист - нет
+    sheet.SetCells({{"B1"_pos, "=A1+1"}, {"A1"_pos, "=C1"}, {"C1"_pos, "5"}, {"C1"_pos, "7"}});
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(7.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(8.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "7");
+
+    auto check_unchanged = [&sheet] {
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=C1");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1+1");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(8.0));
+        ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+        ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 3}));
+    };
+
+    try {
+        sheet.SetCells({{"C1"_pos, "1"}, {"A1"_pos, "=D1+E1"}, {"D1"_pos, "=B1"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    check_unchanged();
+
+    try {
+        sheet.SetCells({{"E1"_pos, "3"}, {"A1"_pos, "=1+"}});
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    check_unchanged();
+
+    try {
+        sheet.SetCells({{"E1"_pos, "3"}, {Position::NONE, "1"}});
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+    check_unchanged();
+}
+
+void TestRecalculateAllInParallel() {
+    // широкий неглубокий граф: A - числа, B = 2A, C = B(i) + B(i+1), D1 = сумма пяти C
+    constexpr int ROWS = 2000;
+    Sheet sheet;
+    auto fill = [&sheet](int base) {
+        for (int row = 0; row < ROWS; ++row) {
+            const std::string r = std::to_string(row + 1);
+            const std::string next = std::to_string(row + 2);
+            sheet.SetCell(Position{row, 0}, std::to_string(base + row));
+            sheet.SetCell(Position{row, 1}, "=A" + r + "*2");
+            sheet.SetCell(Position{row, 2}, "=B" + r + "+B" + next);
+        }
+        sheet.SetCell("D1"_pos, "=C1+C2+C3+C4+C5");
+    };
+    auto check = [&sheet](int base) {
+        for (int row = 0; row < ROWS; ++row) {
+            ASSERT(!sheet.GetConcreteCell(Position{row, 2})->IsDirty());
+            const double expected = row + 1 < ROWS ? 2.0 * (2 * (base + row) + 1) : 2.0 * (base + row);
+            ASSERT_EQUAL(sheet.GetCell(Position{row, 2})->GetValue(), CellInterface::Value(expected));
+        }
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(20.0 * base + 50.0));
+    };
+
+    fill(0);
+    sheet.RecalculateAll(4);
+    check(0);
+
+    // после правок пересчитываются только устаревшие ячейки
+    fill(10);
+    ASSERT(sheet.GetConcreteCell("D1"_pos)->IsDirty());
+    sheet.RecalculateAll(3);
+    check(10);
+
+    sheet.RecalculateAll(1);
+    check(10);
+}
+
+void TestConcurrentReaders() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 1; row < 200; ++row) {
+        sheet.SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    sheet.SetCell("B1"_pos, "=A200*10");
+
+    std::atomic<bool> stop{false};
+    std::atomic<int> failures{0};
+    auto read = [&] {
+        while (!stop.load()) {
+            auto lock = sheet.LockForReading();
+            const double a1 = std::get<double>(sheet.GetConcreteCell("A1"_pos)->GetNumericValue());
+            const auto b1 = sheet.GetCell("B1"_pos)->GetValue();
+            if (!(b1 == CellInterface::Value((a1 + 199) * 10))) {
+                ++failures;
+            }
+        }
+    };
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back(read);
+    }
+    for (int i = 0; i < 200; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i % 7));
+        if (i % 50 == 0) {
+            auto lock = sheet.LockForReading();
+            sheet.RecalculateAll(2);
+        }
+    }
+    stop = true;
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    ASSERT_EQUAL(failures.load(), 0);
+}
+
+void TestSnapshots() {
+    auto sheet = std::make_unique<Sheet>();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("B1"_pos, "=A1*10");
+    sheet->SetCell("B2"_pos, "'text");
+
+    auto first = sheet->Snapshot();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("C3"_pos, "=B1+1");
+    sheet->ClearCell("B2"_pos);
+    auto second = sheet->Snapshot();
+    auto third = sheet->Snapshot();
+
+    // первый снимок не видит правок, в том числе пересчитанных значений
+    ASSERT_EQUAL(first->GetCell("A1"_pos)->GetText(), "1");
+    ASSERT_EQUAL(first->GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(first->GetCell("B2"_pos)->GetValue(), CellInterface::Value(std::string("text")));
+    ASSERT(first->GetCell("C3"_pos) == nullptr);
+    ASSERT_EQUAL(first->GetPrintableSize(), (Size{2, 2}));
+
+    ASSERT_EQUAL(second->GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT_EQUAL(second->GetCell("C3"_pos)->GetValue(), CellInterface::Value(21.0));
+    ASSERT_EQUAL(second->GetCell("C3"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
+    ASSERT(second->GetCell("B2"_pos) == nullptr);
+
+    // снимок печатается так же, как лист в тот момент, и переживает лист
+    std::ostringstream live_values, live_texts;
+    sheet->PrintValues(live_values);
+    sheet->PrintTexts(live_texts);
+    sheet.reset();
+
+    std::ostringstream values, texts;
+    third->PrintValues(values);
+    third->PrintTexts(texts);
+    ASSERT_EQUAL(values.str(), live_values.str());
+    ASSERT_EQUAL(texts.str(), live_texts.str());
+    ASSERT_EQUAL(second->GetCell("A1"_pos)->GetText(), "2");
+}
+
+void TestAggregateFunctions() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("B1"_pos, "3");
+    sheet.SetCell("B2"_pos, "=A1+A2");
+
+    auto value = [&sheet](std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+
+    sheet.SetCell("C1"_pos, "=SUM(A1:B2)");
+    sheet.SetCell("C2"_pos, "=AVERAGE(B2:A1, 10)");
+    sheet.SetCell("C3"_pos, "=MIN(A1:B2)*MAX(A1:B2)");
+    sheet.SetCell("C4"_pos, "=COUNT(A1:B3,A1)");
+    ASSERT_EQUAL(value("C1"), CellInterface::Value(9.0));
+    ASSERT_EQUAL(value("C2"), CellInterface::Value(3.8));
+    ASSERT_EQUAL(value("C3"), CellInterface::Value(3.0));
+    ASSERT_EQUAL(value("C4"), CellInterface::Value(5.0));
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=AVERAGE(A1:B2,10)");
+
+    // пустой диапазон
+    sheet.SetCell("D1"_pos, "=AVERAGE(E1:E9)");
+    sheet.SetCell("D2"_pos, "=MIN(E1:E9)+COUNT(E1:E9)");
+    ASSERT_EQUAL(value("D1"), CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+    ASSERT_EQUAL(value("D2"), CellInterface::Value(0.0));
+
+    // изменение и создание ячеек внутри диапазона
+    sheet.SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(value("C1"), CellInterface::Value(15.0));
+    sheet.SetCell("E5"_pos, "7");
+    ASSERT_EQUAL(value("D1"), CellInterface::Value(7.0));
+    sheet.SetCell("E5"_pos, "=C1");
+    ASSERT_EQUAL(value("D2"), CellInterface::Value(16.0));
+    sheet.ClearCell("E5"_pos);
+    ASSERT_EQUAL(value("D2"), CellInterface::Value(0.0));
+
+    // ошибка внутри диапазона
+    sheet.SetCell("B1"_pos, "=1/0");
+    ASSERT_EQUAL(value("C1"), CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+    sheet.SetCell("B1"_pos, "3");
+    ASSERT_EQUAL(value("C1"), CellInterface::Value(15.0));
+
+    // цикл через диапазон
+    try {
+        sheet.SetCell("A2"_pos, "=SUM(A1:A3)");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet.SetCell("A2"_pos, "=C4");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "2");
+
+    try {
+        sheet.SetCell("F1"_pos, "=SUM(A1:B2");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+}
+
+void TestRangeDependencyIndex() {
+    Sheet sheet;
+    auto value = [&sheet](Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+
+    // диапазон во все строки листа и диапазон больше порога тайлов
+    const Position last_row{Position::MAX_ROWS - 1, 0};
+    sheet.SetCell("B1"_pos, "=SUM(A1:A16384)");
+    sheet.SetCell("C1"_pos, "=COUNT(A2:ZZ16384)");
+    sheet.SetCell(last_row, "5");
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(5.0));
+    ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(1.0));
+    sheet.SetCell("ZZ9000"_pos, "1");
+    ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(2.0));
+
+    // позиция внутри двух диапазонов одной формулы
+    sheet.SetCell("D1"_pos, "=SUM(A1:A10,A5:A20)");
+    sheet.SetCell("A5"_pos, "1");
+    ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(2.0));
+
+    // много формул с непересекающимися диапазонами
+    const int count = 2000;
+    for (int i = 0; i < count; ++i) {
+        const Position from{i * 3, 100};
+        const Position to{i * 3 + 2, 101};
+        sheet.SetCell({i, 200}, "=SUM(" + from.ToString() + ":" + to.ToString() + ")");
+    }
+    for (int i = 0; i < count; ++i) {
+        sheet.SetCell({i * 3 + 1, 101}, std::to_string(i));
+    }
+    for (int i = 0; i < count; ++i) {
+        ASSERT_EQUAL(value({i, 200}), CellInterface::Value(static_cast<double>(i)));
+    }
+
+    // после замены формулы старые диапазоны больше не действуют
+    sheet.SetCell("B1"_pos, "=A5");
+    sheet.SetCell("C1"_pos, "=SUM(A5:A6)");
+    sheet.SetCell(last_row, "7");
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(1.0));
+    ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(1.0));
+    sheet.ClearCell("D1"_pos);
+    sheet.SetCell("A6"_pos, "=B1+1");
+    ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(3.0));
+}
+
+void TestColumnarValueCache() {
+    Sheet sheet;
+    auto value = [&sheet](Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+
+    // столбец через границы тайлов: числа, текст с числом и формулы
+    const int rows = 300;
+    double expected = 0;
+    for (int i = 0; i < rows; ++i) {
+        const Position pos{i, 0};
+        if (i % 3 == 0) {
+            sheet.SetCell(pos, std::to_string(i));
+        } else if (i % 3 == 1) {
+            sheet.SetCell(pos, "=" + Position{i - 1, 0}.ToString() + "+1");
+        }
+        expected += i % 3 == 2 ? 0 : i;
+    }
+    sheet.SetCell("B1"_pos, "=SUM(A1:A300)");
+    sheet.SetCell("B2"_pos, "=COUNT(A1:A300)");
+    sheet.SetCell("B3"_pos, "=A2*2");
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(expected));
+    ASSERT_EQUAL(value("B2"_pos), CellInterface::Value(200.0));
+    ASSERT_EQUAL(value("B3"_pos), CellInterface::Value(2.0));
+
+    // изменения видны и через ссылку, и через диапазон
+    sheet.SetCell("A1"_pos, "10");
+    ASSERT_EQUAL(value("B3"_pos), CellInterface::Value(22.0));
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(expected + 20));
+    sheet.SetCell("A3"_pos, "text");
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    sheet.ClearCell("A3"_pos);
+    sheet.SetCell("A1"_pos, "=1/0");
+    sheet.RecalculateAll(2);
+    ASSERT_EQUAL(value("B3"_pos), CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+    sheet.SetCell("A1"_pos, "0");
+    sheet.RecalculateAll(2);
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(expected));
+}
+
+void TestCellPoolReuse() {
+    auto sheet = CreateSheet();
+    // заполняем, очищаем и заполняем заново: места удалённых ячеек переиспользуются
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 1000; ++i) {
+            sheet->SetCell({i, 0}, std::to_string(i + round));
+            sheet->SetCell({i, 1}, "=SUM(A1:" + Position{i, 0}.ToString() + ")+(A1*2-A1)/1");
+        }
+        ASSERT_EQUAL(sheet->GetCell({999, 1})->GetValue(),
+                     CellInterface::Value(499500.0 + 1000.0 * round + round));
+        ASSERT_EQUAL(sheet->GetCell({999, 1})->GetText(), "=SUM(A1:A1000)+(A1*2-A1)/1");
+        for (int i = 0; i < 1000; ++i) {
+            sheet->ClearCell({i, 1});
+            sheet->ClearCell({i, 0});
+        }
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+    }
+}
+
+void TestSharedFormulaTemplates() {
+    Sheet sheet;
+    const int rows = 1000;
+    for (int i = 0; i < rows; ++i) {
+        const std::string row = std::to_string(i + 1);
+        sheet.SetCell({i, 1}, std::to_string(i));
+        sheet.SetCell({i, 2}, "2");
+        // одна и та же формула в относительной записи, по-разному записанная
+        sheet.SetCell({i, 0}, i % 2 ? "=B" + row + "*C" + row : "= B" + row + " * C" + row);
+    }
+    for (int i = 0; i < rows; ++i) {
+        const std::string row = std::to_string(i + 1);
+        ASSERT_EQUAL(sheet.GetCell({i, 0})->GetText(), "=B" + row + "*C" + row);
+        ASSERT_EQUAL(sheet.GetCell({i, 0})->GetValue(), CellInterface::Value(2.0 * i));
+        ASSERT_EQUAL(sheet.GetCell({i, 0})->GetReferencedCells(), (std::vector{Position{i, 1}, Position{i, 2}}));
+    }
+
+    // шаблон переживает ячейку, где был разобран
+    sheet.ClearCell("A1"_pos);
+    sheet.SetCell("A1"_pos, "=B1*C1");
+    sheet.SetCell("B500"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(sheet.GetCell("A500"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    // сдвигаются и диапазоны
+    sheet.SetCell("D1"_pos, "=SUM(B1:C3)+B1");
+    sheet.SetCell("D3"_pos, "=SUM(B3:C5)+B3");
+    ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetText(), "=SUM(B3:C5)+B3");
+    ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), CellInterface::Value(17.0));
+    sheet.SetCell("C4"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), CellInterface::Value(20.0));
+
+    // одинаковая относительная запись не делает цикл незаметным
+    sheet.SetCell("E1"_pos, "=E2+1");
+    try {
+        sheet.SetCell("E2"_pos, "=E3+1");
+        sheet.SetCell("E3"_pos, "=E1+1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+}
+
+void TestLoadTexts() {
+    // PrintTexts -> LoadTexts даёт тот же лист
+    Sheet source;
+    source.SetCell("A1"_pos, "text");
+    source.SetCell("C1"_pos, "=A2+B3");
+    source.SetCell("A2"_pos, "'=escaped");
+    source.SetCell("B3"_pos, "3");
+    source.SetCell("D4"_pos, "=SUM(A1:C3)");
+    std::ostringstream texts;
+    source.PrintTexts(texts);
+
+    Sheet loaded;
+    loaded.LoadTexts(texts.str());
+    std::ostringstream loaded_texts, source_values, loaded_values;
+    loaded.PrintTexts(loaded_texts);
+    source.PrintValues(source_values);
+    loaded.PrintValues(loaded_values);
+    ASSERT_EQUAL(loaded_texts.str(), texts.str());
+    ASSERT_EQUAL(loaded_values.str(), source_values.str());
+
+    // CSV с "\r\n"; ссылки вперёд и параллельный разбор, поток читается кусками
+    const int rows = 5000;
+    std::string csv;
+    for (int i = 0; i < rows; ++i) {
+        const std::string next = std::to_string(i + 2);
+        csv += i + 1 < rows ? "=B" + next + "+A" + next : "1";
+        csv += "," + std::to_string(i) + ",,=A" + std::to_string(i + 1) + "*2\r\n";
+    }
+    std::istringstream input(csv);
+    Sheet big;
+    big.LoadTexts(input, ',', 4);
+    ASSERT_EQUAL(big.GetPrintableSize(), (Size{rows, 4}));
+    ASSERT(big.GetCell({0, 2}) == nullptr);
+    const double sum = 1.0 + (rows - 1.0) * rows / 2;
+    ASSERT_EQUAL(big.GetCell("A1"_pos)->GetValue(), CellInterface::Value(sum));
+    ASSERT_EQUAL(big.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2 * sum));
+
+    // ошибка в любой строке - лист не меняется
+    try {
+        loaded.LoadTexts("=B1\t=A1\n");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        loaded.LoadTexts("1\t2\n=1+\n");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    std::ostringstream after;
+    loaded.PrintTexts(after);
+    ASSERT_EQUAL(after.str(), texts.str());
+
+    // данные из памяти тоже разбираются кусками: строка длиннее куска,
+    // ошибка в последнем куске не меняет лист
+    const std::string long_text(3 << 20, 'x');
+    Sheet chunked;
+    chunked.LoadTexts("1\t" + long_text + "\n=A1+1\n");
+    ASSERT_EQUAL(chunked.GetCell("B1"_pos)->GetText(), long_text);
+    ASSERT_EQUAL(chunked.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+    try {
+        chunked.LoadTexts("5\n" + long_text + "\n=1+\n");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    ASSERT_EQUAL(chunked.GetCell("A1"_pos)->GetText(), "1");
+    ASSERT_EQUAL(chunked.GetCell("B1"_pos)->GetText(), long_text);
+
+    // пустое поле очищает ячейку под собой, ячейки вне полей не меняются
+    Sheet merged;
+    merged.SetCell("A1"_pos, "old");
+    merged.SetCell("B1"_pos, "3");
+    merged.SetCell("C1"_pos, "outside");
+    merged.SetCell("A2"_pos, "=B1");
+    ASSERT_EQUAL(merged.GetCell("A2"_pos)->GetValue(), CellInterface::Value(3.0));
+    merged.LoadTexts("new\t");
+    ASSERT_EQUAL(merged.GetCell("A1"_pos)->GetText(), "new");
+    const CellInterface* cleared = merged.GetCell("B1"_pos);
+    ASSERT(cleared == nullptr || cleared->GetText().empty());
+    ASSERT_EQUAL(merged.GetCell("C1"_pos)->GetText(), "outside");
+    ASSERT_EQUAL(merged.GetCell("A2"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
+void TestBufferedPrint() {
+    // числа печатаются так же, как их печатает std::ostream
+    const double numbers[] = {0.1, 1e20, 123456789, -0.5, 1.0 / 3, 1e-7, 100, 0, 2.5e-300};
+    Sheet sheet;
+    std::ostringstream expected_values;
+    for (size_t i = 0; i < std::size(numbers); ++i) {
+        std::ostringstream formula;
+        formula << std::setprecision(17) << '=' << numbers[i];
+        sheet.SetCell({0, static_cast<int>(i)}, formula.str());
+        expected_values << (i > 0 ? "\t" : "") << numbers[i];
+    }
+    expected_values << '\n';
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str(), expected_values.str());
+
+    // большой разреженный лист: пустые тайлы, ошибки, тексты; параллельная
+    // печать совпадает с последовательной
+    Sheet big;
+    for (int row = 0; row < 1000; row += 7) {
+        big.SetCell({row, row % 150}, std::to_string(row));
+        big.SetCell({row, 149 - row % 150}, "=A1/" + std::to_string(row % 2));
+    }
+    big.SetCell({1200, 3}, "tail");
+    std::ostringstream sequential, parallel, sequential_texts, parallel_texts;
+    big.PrintValues(sequential);
+    big.PrintValues(parallel, 3);
+    big.PrintTexts(sequential_texts);
+    big.PrintTexts(parallel_texts, 0);
+    ASSERT_EQUAL(parallel.str(), sequential.str());
+    ASSERT_EQUAL(parallel_texts.str(), sequential_texts.str());
+    const std::string out = sequential.str();
+    ASSERT_EQUAL(std::count(out.begin(), out.end(), '\n'), 1201);
+    ASSERT_EQUAL(std::count(out.begin(), out.end(), '\t'), 1201 * 149);
+    ASSERT(out.find("#ARITHM!") != std::string::npos);
+
+    // снимок печатается так же, как лист
+    std::ostringstream snapshot_values;
+    big.Snapshot()->PrintValues(snapshot_values);
+    ASSERT_EQUAL(snapshot_values.str(), out);
+}
+
+void TestBinarySave() {
+    Sheet source;
+    source.SetCell("A1"_pos, "2");
+    source.SetCell("B1"_pos, "'=text");
+    source.SetCell("C1"_pos, "=A1/0");
+    for (int row = 1; row < 100; ++row) {
+        source.SetCell({row, 0}, "=A" + std::to_string(row) + "*2+1");
+    }
+    source.SetCell("B2"_pos, "=SUM(A1:A100)+-+C1");
+    source.SetCell("B3"_pos, "=MAX(A1:A3,1.5e300)");
+    source.GetCell("A100"_pos)->GetValue();  // часть значений готова, часть - нет
+    std::ostringstream saved;
+    source.Save(saved);
+    const std::string data = saved.str();
+
+    std::ostringstream source_texts, source_values;
+    source.PrintTexts(source_texts);
+    source.PrintValues(source_values);
+
+    Sheet loaded;
+    loaded.Load(data);
+    // сохранённые значения загружены готовыми
+    ASSERT(!loaded.GetConcreteCell("A100"_pos)->IsDirty());
+    ASSERT(loaded.GetConcreteCell("B2"_pos)->IsDirty());
+    std::ostringstream loaded_texts, loaded_values;
+    loaded.PrintTexts(loaded_texts);
+    loaded.PrintValues(loaded_values);
+    ASSERT_EQUAL(loaded_texts.str(), source_texts.str());
+    ASSERT_EQUAL(loaded_values.str(), source_values.str());
+
+    // граф восстановлен: изменение источника доходит до зависимых
+    loaded.SetCell("A1"_pos, "0");
+    ASSERT_EQUAL(loaded.GetCell("A2"_pos)->GetValue(), CellInterface::Value(1.0));
+    try {
+        loaded.SetCell("A1"_pos, "=B2");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    // формулы одного шаблона после загрузки снова общие
+    const auto* a2 = loaded.GetConcreteCell("A2"_pos)->GetFormula();
+    const auto* a50 = loaded.GetConcreteCell("A50"_pos)->GetFormula();
+    ASSERT(a2->GetAST() == a50->GetAST());
+
+    // загрузка поверх непустого листа пересчитывает зависимые
+    Sheet target;
+    target.SetCell("D1"_pos, "=A1+1");
+    ASSERT_EQUAL(target.GetCell("D1"_pos)->GetValue(), CellInterface::Value(1.0));
+    target.Load(data);
+    ASSERT_EQUAL(target.GetCell("D1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    // повреждённые данные: исключение, лист прежний
+    std::ostringstream texts_before;
+    target.PrintTexts(texts_before);
+    for (size_t size = 0; size < data.size(); size += 7) {
+        try {
+            target.Load(std::string_view(data).substr(0, size));
+            ASSERT(false);
+        } catch (const BinaryFormatError&) {
+        }
+    }
+    std::string broken = data;
+    broken[4] = 99;  // версия
+    try {
+        target.Load(broken);
+        ASSERT(false);
+    } catch (const BinaryFormatError&) {
+    }
+    // слишком глубокое выражение отвергается, а не переполняет стек
+    for (const size_t minuses : {size_t{100}, FormulaAST::MAX_DEPTH - 1, FormulaAST::MAX_DEPTH, size_t{1000000}}) {
+        std::string tree;
+        for (size_t i = 0; i < minuses; ++i) {
+            tree += "\x03-";  // унарный минус
+        }
+        tree.append(9, '\0');  // число 0
+        BinaryReader in(tree);
+        try {
+            const FormulaAST ast = FormulaAST::Deserialize(in);
+            ASSERT(minuses < FormulaAST::MAX_DEPTH);
+            ASSERT(in.AtEnd());
+        } catch (const BinaryFormatError&) {
+            ASSERT(minuses >= FormulaAST::MAX_DEPTH);
+        }
+    }
+    // огромное число шаблонов в заголовке не должно приводить к выделению памяти
+    try {
+        target.Load(data.substr(0, 8) + "\xff\xff\xff\xff");
+        ASSERT(false);
+    } catch (const BinaryFormatError&) {
+    }
+    std::ostringstream texts_after;
+    target.PrintTexts(texts_after);
+    ASSERT_EQUAL(texts_after.str(), texts_before.str());
+
+    // цепочка предельной глубины сохраняется и загружается обратно,
+    // а более глубокая не принимается уже при записи в ячейку
+    {
+        Sheet chain;
+        chain.SetCell("A1"_pos, "1");
+        std::string formula = "=A1";
+        for (size_t i = 1; i < FormulaAST::MAX_DEPTH; ++i) {
+            formula += "+A1";
+        }
+        chain.SetCell("B1"_pos, formula);
+        const CellInterface::Value sum(static_cast<double>(FormulaAST::MAX_DEPTH));
+        ASSERT_EQUAL(chain.GetCell("B1"_pos)->GetValue(), sum);
+        std::ostringstream chain_saved;
+        chain.Save(chain_saved);
+
+        Sheet chain_loaded;
+        chain_loaded.Load(chain_saved.str());
+        ASSERT_EQUAL(chain_loaded.GetCell("B1"_pos)->GetText(), formula);
+        ASSERT_EQUAL(chain_loaded.GetCell("B1"_pos)->GetValue(), sum);
+        try {
+            chain.SetCell("B2"_pos, formula + "+A1");
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+
+    // цикл загруженных формул с ячейками листа: исключение, лист прежний
+    {
+        Sheet small;
+        small.SetCell("A1"_pos, "=C1");
+        std::ostringstream small_saved;
+        small.Save(small_saved);
+        Sheet with_cycle;
+        with_cycle.SetCell("C1"_pos, "=A1+1");
+        try {
+            with_cycle.Load(small_saved.str());
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        const CellInterface* a1 = with_cycle.GetCell("A1"_pos);
+        ASSERT(a1 == nullptr || a1->GetText().empty());
+        ASSERT_EQUAL(with_cycle.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+    }
+
+    // загрузка из файла
+    const std::string path = "binary_save_test.sheet";
+    {
+        std::ofstream file(path, std::ios::binary);
+        source.Save(file);
+    }
+    Sheet mapped;
+    mapped.LoadMapped(path);
+    std::remove(path.c_str());
+    std::ostringstream mapped_values;
+    mapped.PrintValues(mapped_values);
+    ASSERT_EQUAL(mapped_values.str(), source_values.str());
+}
+
+void TestSheetStats() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+
+    // пока счётчики выключены, в отчёте только состояние листа
+    SheetStatsReport report = sheet.GetStats();
+    ASSERT_EQUAL(report.formula_parses, 0u);
+    ASSERT_EQUAL(report.live_cells, 1u);
+    ASSERT_EQUAL(report.edges, 0u);
+    ASSERT(report.memory.tiles > 0 && report.memory.cell_pool > 0);
+    if (!STATS_COMPILED) {
+        return;
+    }
+
+    sheet.EnableStats();
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2+1");  // тот же шаблон, что в A2
+    sheet.SetCell("A4"_pos, "=A1*A1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 3.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 2.0);
+    sheet.SetCell("A1"_pos, "5");
+
+    report = sheet.GetStats();
+    ASSERT_EQUAL(report.formula_parses, 2u);
+    ASSERT_EQUAL(report.formula_template_hits, 1u);
+    ASSERT_EQUAL(report.cache_misses, 1u);
+    ASSERT_EQUAL(report.cache_hits, 1u);
+    ASSERT_EQUAL(report.evaluations, 2u);
+    ASSERT_EQUAL(report.evaluations_per_recalculation.count, 1u);
+    ASSERT_EQUAL(report.evaluations_per_recalculation.buckets[2], 1u);  // 2 из [2, 4)
+    ASSERT_EQUAL(report.invalidation_fan_out.max, 2u);  // A2 и A3; у A4 кэша не было
+    ASSERT_EQUAL(report.cycle_check_visits.count, 4u);  // по одной на SetCell
+    ASSERT_EQUAL(report.live_cells, 4u);
+    ASSERT_EQUAL(report.edges, 3u);
+
+    // пересчёт на потоках - тоже один пересчёт
+    sheet.RecalculateAll(2);
+    report = sheet.GetStats();
+    ASSERT_EQUAL(report.evaluations, 5u);
+    ASSERT_EQUAL(report.evaluations_per_recalculation.max, 3u);
+
+    sheet.ResetStats();
+    sheet.EnableStats(false);
+    sheet.SetCell("B1"_pos, "=A1");
+    sheet.GetCell("B1"_pos)->GetValue();
+    report = sheet.GetStats();
+    ASSERT_EQUAL(report.formula_parses, 0u);
+    ASSERT_EQUAL(report.cache_misses, 0u);
+    ASSERT_EQUAL(report.evaluations_per_recalculation.count, 0u);
+    ASSERT_EQUAL(report.edges, 4u);
+}
+
+void TestConstantFolding() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "10");
+    sheet.SetCell("A2"_pos, "text");
+    auto value_of = [&sheet](std::string text) {
+        sheet.SetCell("B1"_pos, std::move(text));
+        return sheet.GetCell("B1"_pos)->GetValue();
+    };
+
+    // константы считаются при разборе, но результат и текст - те же
+    ASSERT_EQUAL(value_of("=A1*(1+0.07)/12"), CellInterface::Value(10 * (1 + 0.07) / 12));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1*(1+0.07)/12");
+    ASSERT_EQUAL(value_of("=(2*3-1)*A1"), CellInterface::Value(50.0));
+    ASSERT_EQUAL(value_of("=SUM(A1,2*-3)"), CellInterface::Value(4.0));
+    ASSERT_EQUAL(value_of("=--A1"), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=--A1");
+    ASSERT_EQUAL(value_of("=---A1"), CellInterface::Value(-10.0));
+    ASSERT_EQUAL(value_of("=A1*1-0"), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1*1-0");
+
+    // x-0 сохраняет знак нуля, x+0 - нет
+    ASSERT(std::signbit(std::get<double>(value_of("=0*-A1-0"))));
+    ASSERT(!std::signbit(std::get<double>(value_of("=0*-A1+0"))));
+
+    // ошибки не сворачиваются и не обгоняют ошибки операндов слева
+    ASSERT_EQUAL(value_of("=A1+1/0"), CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(value_of("=A1/(2-2)"), CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(value_of("=A1+1e308*10"), CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(value_of("=A2+1/0"), CellInterface::Value(FormulaError::Category::Value));
+
+    // x*1, x/1 и x-0 не сворачиваются: бесконечность или nan из текста
+    // должны давать ошибку, как и без свёртки
+    sheet.SetCell("A3"_pos, "inf");
+    sheet.SetCell("A4"_pos, "nan");
+    for (const std::string operand : {"A3", "A4"}) {
+        for (const char* tail : {"*1", "/1", "-0", "/2"}) {
+            ASSERT_EQUAL(value_of("=" + operand + tail), CellInterface::Value(FormulaError::Category::Arithmetic));
+        }
+    }
+}
+
+void TestEagerRecalculation() {
+    Sheet eager;
+    Sheet lazy;
+    eager.SetRecalculationMode(Sheet::RecalculationMode::EAGER);
+    eager.EnableStats();
+    auto set_both = [&](Position pos, std::string text) {
+        lazy.SetCell(pos, text);
+        eager.SetCell(pos, std::move(text));
+    };
+
+    set_both("A1"_pos, "2");
+    set_both("B1"_pos, "=A1*0");
+    set_both("C1"_pos, "=B1+1");
+    for (int row = 1; row < 100; ++row) {
+        set_both({row, 2}, "=C" + std::to_string(row) + "+1");
+    }
+    set_both("D1"_pos, "=A1*3");
+    const CellInterface::Value hundred = 100.0;
+    ASSERT(!eager.GetConcreteCell("C100"_pos)->IsDirty());
+    ASSERT_EQUAL(eager.GetCell("C100"_pos)->GetValue(), hundred);
+
+    // значение B1 не меняется - цепочка под ним не пересчитывается
+    auto snapshot = eager.Snapshot();
+    eager.ResetStats();
+    set_both("A1"_pos, "4");
+    ASSERT(!eager.GetConcreteCell("D1"_pos)->IsDirty());
+    ASSERT_EQUAL(eager.GetCell("D1"_pos)->GetValue(), CellInterface::Value(12.0));
+    ASSERT_EQUAL(snapshot->GetCell("D1"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(eager.Snapshot()->GetCell("D1"_pos)->GetValue(), CellInterface::Value(12.0));
+    if (STATS_COMPILED) {
+        ASSERT_EQUAL(eager.GetStats().evaluations, 2u);  // B1 и D1
+    }
+
+    // то же число в другом виде не доходит до зависимых
+    eager.ResetStats();
+    set_both("A1"_pos, "4.0");
+    if (STATS_COMPILED) {
+        ASSERT_EQUAL(eager.GetStats().evaluations, 0u);
+    }
+
+    // изменившееся значение проходит цепочку до конца
+    set_both("A1"_pos, "text");
+    ASSERT_EQUAL(eager.GetCell("C100"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    lazy.ClearCell("A1"_pos);
+    eager.ClearCell("A1"_pos);
+    ASSERT_EQUAL(eager.GetCell("C100"_pos)->GetValue(), hundred);
+    lazy.SetCells({{"A1"_pos, "=E1"}, {"E1"_pos, "1/0"}, {"C50"_pos, "=D1"}});
+    eager.SetCells({{"A1"_pos, "=E1"}, {"E1"_pos, "1/0"}, {"C50"_pos, "=D1"}});
+    ASSERT(!eager.GetConcreteCell("C100"_pos)->IsDirty());
+
+    std::ostringstream lazy_values, eager_values;
+    lazy.PrintValues(lazy_values);
+    eager.PrintValues(eager_values);
+    ASSERT_EQUAL(eager_values.str(), lazy_values.str());
+}
+
+void TestBackgroundRecalculation() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 1; row < 1000; ++row) {
+        sheet.SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    sheet.SetCell("B1"_pos, "=A1000*2");
+
+    // без фонового пересчёта значение неизвестно, пока его не прочитают
+    Cell::KnownValue known = sheet.TryGetValue("B1"_pos);
+    ASSERT(known.stale && !known.value);
+    ASSERT_EQUAL(*sheet.TryGetValue("A1"_pos).value, CellInterface::Value("1"));
+    ASSERT(!sheet.TryGetValue("Z9"_pos).stale);
+
+    // ждёт, пока фоновый поток не вычислит ячейку
+    auto wait_fresh = [&sheet](Position pos) {
+        for (int attempt = 0; attempt < 10000; ++attempt) {
+            Cell::KnownValue value = sheet.TryGetValue(pos);
+            if (!value.stale) {
+                return *value.value;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        throw std::runtime_error("background recalculation did not finish");
+    };
+
+    sheet.StartBackgroundRecalculation();
+    ASSERT_EQUAL(wait_fresh("B1"_pos), CellInterface::Value(2000.0));
+
+    // после изменения видно прежнее значение с пометкой, затем новое
+    sheet.SetViewport(Range::FromString("B1:B1"));
+    sheet.SetCell("A1"_pos, "2");
+    known = sheet.TryGetValue("B1"_pos);
+    if (known.stale && known.value) {
+        ASSERT_EQUAL(*known.value, CellInterface::Value(2000.0));
+    }
+    ASSERT_EQUAL(wait_fresh("B1"_pos), CellInterface::Value(2002.0));
+
+    // запись и чтение вперемешку с фоновым пересчётом
+    std::thread reader([&sheet] {
+        for (int i = 0; i < 200; ++i) {
+            const auto lock = sheet.LockForReading();
+            sheet.TryGetValue({i, 0});
+            sheet.GetCell({999 - i, 0})->GetValue();
+        }
+    });
+    for (int i = 0; i < 50; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i));
+    }
+    reader.join();
+    ASSERT_EQUAL(wait_fresh("A1000"_pos), CellInterface::Value(1048.0));
+    sheet.StopBackgroundRecalculation();
+    sheet.SetCell("A1"_pos, "0");
+    ASSERT(sheet.TryGetValue("B1"_pos).stale);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1998.0));
+}
+
+void TestResolvedReferences() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1+C200*2");  // источники создаются пустыми
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT(sheet.GetConcreteCell("C200"_pos)->IsEmpty());
+
+    sheet.SetCell("B1"_pos, "1");
+    sheet.SetCell("C200"_pos, "=B1*10");  // устаревший источник вычисляется по запросу
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(21.0));
+    sheet.SetCell("B1"_pos, "x");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+
+    // откат пакета возвращает формуле прежние источники
+    sheet.SetCell("B1"_pos, "2");
+    try {
+        sheet.SetCells({{"A1"_pos, "=D1"}, {"D1"_pos, "=A1"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=B1+C200*2");
+    sheet.SetCell("B1"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(63.0));
+
+    // очищенный источник остаётся пустой ячейкой
+    sheet.ClearCell("C200"_pos);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.0));
+    sheet.SetCell("C200"_pos, "4");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(11.0));
+}
+
+void TestWritersGoFirst() {
+    ReadWriteMutex mutex;
+    std::vector<int> order;
+    std::mutex order_mutex;
+    auto record = [&](int who) {
+        std::lock_guard guard(order_mutex);
+        order.push_back(who);
+    };
+
+    std::shared_lock first_reader(mutex);
+    std::thread writer([&] {
+        std::unique_lock lock(mutex);
+        record(1);
+    });
+    while (!mutex.HasWaitingWriters()) {
+        std::this_thread::yield();
+    }
+    // писатель ждёт - новый читатель пропускает его вперёд
+    std::thread reader([&] {
+        std::shared_lock lock(mutex);
+        record(2);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    ASSERT(order.empty());
+
+    first_reader.unlock();
+    writer.join();
+    reader.join();
+    ASSERT_EQUAL(order, (std::vector{1, 2}));
+    ASSERT(!mutex.HasWaitingWriters());
+}
+
+void TestSnapshotsAfterRelease() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+
+    // все снимки удалены - лист перестаёт копить изменения, следующий
+    // снимок замораживается заново
+    sheet.Snapshot();
+    for (int i = 0; i < 100; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i));
+    }
+    auto fresh = sheet.Snapshot();
+    ASSERT_EQUAL(fresh->GetCell("B1"_pos)->GetValue(), CellInterface::Value(100.0));
+
+    // старый снимок жив, последний удалён
+    auto old = sheet.Snapshot();
+    fresh.reset();
+    sheet.Snapshot();
+    sheet.SetCell("A1"_pos, "5");
+    sheet.ClearCell("B1"_pos);
+    sheet.SetCell("C1"_pos, "=A1*2");
+    auto latest = sheet.Snapshot();
+    ASSERT_EQUAL(old->GetCell("B1"_pos)->GetValue(), CellInterface::Value(100.0));
+    ASSERT(old->GetCell("C1"_pos) == nullptr);
+    ASSERT(latest->GetCell("B1"_pos) == nullptr);
+    ASSERT_EQUAL(latest->GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+}
+
+void TestSheetMemoryReport() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("B1"_pos, "a rather long text that does not fit into a short string");
+
+    auto memory = sheet.GetStats().memory;
+    ASSERT(memory.contents > 0 && memory.formulas > 0 && memory.formula_cache > 0);
+    ASSERT_EQUAL(memory.snapshots, 0u);
+
+    // тот же шаблон, что в A2: выражение общее и второй раз не считается
+    const size_t formulas = memory.formulas;
+    const size_t range_index = memory.range_index;
+    sheet.SetCell("A3"_pos, "=A2+1");
+    ASSERT_EQUAL(sheet.GetStats().memory.formulas, formulas);
+
+    sheet.SetCell("C1"_pos, "=SUM(A1:A3)");
+    memory = sheet.GetStats().memory;
+    ASSERT(memory.formulas > formulas);
+    ASSERT(memory.range_index > range_index);
+
+    {
+        auto snapshot = sheet.Snapshot();
+        ASSERT(sheet.GetStats().memory.snapshots > 0);
+    }
+    // снимков не осталось - первая же запись сбрасывает копию
+    sheet.SetCell("D1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetStats().memory.snapshots, 0u);
+}
+
+void TestStopBackgroundRecalculation() {
+    constexpr int CHAIN = 10000;
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells{{"A1"_pos, "1"}};
+    for (int row = 1; row < CHAIN; ++row) {
+        cells.push_back({{row, 0}, "=A" + std::to_string(row) + "+1"});
+    }
+    sheet.SetCells(std::move(cells));
+    const Position last{CHAIN - 1, 0};
+
+    sheet.StartBackgroundRecalculation();
+    while (sheet.TryGetValue(last).stale) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Фоновый поток начинает новый проход и останавливается на первой же
+    // ячейке: её вычисление ждёт мьютекса пересчёта. Остановка должна
+    // прервать проход, а не досчитывать лист до конца
+    std::unique_lock recalculation(sheet.GetRecalculationMutex());
+    sheet.SetCell("A1"_pos, "2");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::thread stopper([&sheet] {
+        sheet.StopBackgroundRecalculation();
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    recalculation.unlock();
+    stopper.join();
+
+    ASSERT(sheet.TryGetValue(last).stale);
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(CHAIN + 1.0));
+}
+
+void TestStaleValueDuringRecalculation() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 1; row < 100; ++row) {
+        sheet.SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    sheet.SetCell("B1"_pos, "=1/0");
+    sheet.SetCell("B2"_pos, "=B1+A100");
+
+    sheet.StartBackgroundRecalculation();
+    while (sheet.TryGetValue("A100"_pos).stale || sheet.TryGetValue("B2"_pos).stale) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Фоновый поток посреди прохода: он ждёт мьютекса пересчёта, чтобы
+    // вычислить очередную ячейку. Прежние значения читаются без ожидания
+    std::unique_lock recalculation(sheet.GetRecalculationMutex());
+    sheet.SetCell("A1"_pos, "2");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    {
+        const auto lock = sheet.LockForReading();
+        Cell::KnownValue known = sheet.TryGetValue("A100"_pos);
+        ASSERT(known.stale);
+        ASSERT_EQUAL(*known.value, CellInterface::Value(100.0));
+        known = sheet.TryGetValue("B2"_pos);
+        ASSERT(known.stale);
+        ASSERT_EQUAL(*known.value, CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+    }
+    recalculation.unlock();
+
+    while (sheet.TryGetValue("A100"_pos).stale) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ASSERT_EQUAL(*sheet.TryGetValue("A100"_pos).value, CellInterface::Value(101.0));
+    sheet.StopBackgroundRecalculation();
+}
 }  // namespace
 
 int main() {
@@ -369,4 +1767,37 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestSparseFarCorner);
+    RUN_TEST(tr, TestPrintableSizeAfterClear);
+    RUN_TEST(tr, TestFastParserMatchesAntlr);
+    RUN_TEST(tr, TestFormulaDeepExpression);
+    RUN_TEST(tr, TestParseCellNumber);
+    RUN_TEST(tr, TestErrorPropagation);
+    RUN_TEST(tr, TestFormulaReadsTextNumbers);
+    RUN_TEST(tr, TestDependencyGraphRewiring);
+    RUN_TEST(tr, TestCacheInvalidationChain);
+    RUN_TEST(tr, TestRandomEditsStayConsistent);
+    RUN_TEST(tr, TestDeepChainRecalculation);
+    RUN_TEST(tr, TestSetCellsBatch);
+    RUN_TEST(tr, TestRecalculateAllInParallel);
+    RUN_TEST(tr, TestConcurrentReaders);
+    RUN_TEST(tr, TestSnapshots);
+    RUN_TEST(tr, TestAggregateFunctions);
+    RUN_TEST(tr, TestRangeDependencyIndex);
+    RUN_TEST(tr, TestColumnarValueCache);
+    RUN_TEST(tr, TestCellPoolReuse);
+    RUN_TEST(tr, TestSharedFormulaTemplates);
+    RUN_TEST(tr, TestLoadTexts);
+    RUN_TEST(tr, TestBufferedPrint);
+    RUN_TEST(tr, TestBinarySave);
+    RUN_TEST(tr, TestSheetStats);
+    RUN_TEST(tr, TestConstantFolding);
+    RUN_TEST(tr, TestEagerRecalculation);
+    RUN_TEST(tr, TestBackgroundRecalculation);
+    RUN_TEST(tr, TestResolvedReferences);
+    RUN_TEST(tr, TestWritersGoFirst);
+    RUN_TEST(tr, TestSnapshotsAfterRelease);
+    RUN_TEST(tr, TestSheetMemoryReport);
+    RUN_TEST(tr, TestStopBackgroundRecalculation);
+    RUN_TEST(tr, TestStaleValueDuringRecalculation);
 }
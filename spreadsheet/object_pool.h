@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Пул объектов одного типа. Память берётся блоками по SLAB_SIZE объектов,
+// освобождённые места переиспользуются, а все блоки отдаются разом вместе с
+// пулом. Объекты должны быть уничтожены (Destroy) до уничтожения пула.
+template <typename T, size_t SLAB_SIZE = 256>
+class ObjectPool {
+public:
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    template <typename... Args>
+    T* Create(Args&&... args) {
+        Slot* slot = TakeSlot();
+        try {
+            return new (slot->storage) T(std::forward<Args>(args)...);
+        } catch (...) {
+            ReturnSlot(slot);
+            throw;
+        }
+    }
+
+    void Destroy(T* object) {
+        object->~T();
+        ReturnSlot(reinterpret_cast<Slot*>(object));
+    }
+
+    // Память всех блоков пула, занятых и свободных мест
+    size_t GetAllocatedBytes() const {
+        return slabs_.size() * SLAB_SIZE * sizeof(Slot);
+    }
+
+private:
+    union Slot {
+        Slot* next;
+        alignas(T) std::byte storage[sizeof(T)];
+    };
+
+    Slot* TakeSlot() {
+        if (free_) {
+            return std::exchange(free_, free_->next);
+        }
+        if (used_in_last_slab_ == SLAB_SIZE) {
+            slabs_.push_back(std::make_unique<Slot[]>(SLAB_SIZE));
+            used_in_last_slab_ = 0;
+        }
+        return &slabs_.back()[used_in_last_slab_++];
+    }
+
+    void ReturnSlot(Slot* slot) {
+        slot->next = free_;
+        free_ = slot;
+    }
+
+    std::vector<std::unique_ptr<Slot[]>> slabs_;
+    Slot* free_ = nullptr;
+    size_t used_in_last_slab_ = SLAB_SIZE;
+};
@@ -0,0 +1,87 @@
+#include "range_index.h"
+#include "sheet_stats.h"
+
+#include <algorithm>
+#include <utility>
+
+void RangeIndex::Add(Cell* cell, const std::vector<Range>& ranges) {
+    Remove(cell);
+    if (ranges.empty()) {
+        return;
+    }
+
+    if (CountTiles(ranges) > LARGE_TILE_COUNT) {
+        for (const Range& range : ranges) {
+            large_.push_back({cell, range});
+        }
+    } else {
+        // сначала все пары (тайл, диапазон), чтобы записи формулы в каждой
+        // корзине легли подряд
+        std::vector<std::pair<int, Range>> tiles;
+        for (const Range& range : ranges) {
+            ForEachTile(range, [&](int key) {
+                tiles.push_back({key, range});
+            });
+        }
+        std::sort(tiles.begin(), tiles.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.first < rhs.first;
+        });
+        for (const auto& [key, range] : tiles) {
+            buckets_[key].push_back({cell, range});
+        }
+    }
+    registered_.emplace(cell, ranges);
+}
+
+void RangeIndex::Remove(Cell* cell) {
+    auto it = registered_.find(cell);
+    if (it == registered_.end()) {
+        return;
+    }
+
+    auto erase_cell = [cell](std::vector<Entry>& entries) {
+        entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                     [cell](const Entry& entry) {
+                                         return entry.cell == cell;
+                                     }),
+                      entries.end());
+    };
+
+    if (CountTiles(it->second) > LARGE_TILE_COUNT) {
+        erase_cell(large_);
+    } else {
+        for (const Range& range : it->second) {
+            ForEachTile(range, [&](int key) {
+                auto bucket = buckets_.find(key);
+                if (bucket == buckets_.end()) {
+                    return;  // уже очищена через другой диапазон
+                }
+                erase_cell(bucket->second);
+                if (bucket->second.empty()) {
+                    buckets_.erase(bucket);
+                }
+            });
+        }
+    }
+    registered_.erase(it);
+}
+
+size_t RangeIndex::CountTiles(const std::vector<Range>& ranges) {
+    size_t count = 0;
+    for (const Range& range : ranges) {
+        count += static_cast<size_t>((range.to.row >> TILE_SHIFT) - (range.from.row >> TILE_SHIFT) + 1)
+                 * static_cast<size_t>((range.to.col >> TILE_SHIFT) - (range.from.col >> TILE_SHIFT) + 1);
+    }
+    return count;
+}
+
+size_t RangeIndex::GetMemoryBytes() const {
+    size_t bytes = HashMapBytes(buckets_) + VectorHeapBytes(large_) + HashMapBytes(registered_);
+    for (const auto& [key, entries] : buckets_) {
+        bytes += VectorHeapBytes(entries);
+    }
+    for (const auto& [cell, ranges] : registered_) {
+        bytes += VectorHeapBytes(ranges);
+    }
+    return bytes;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+class Cell;
+
+// Пространственный индекс диапазонов, на которые ссылаются формулы: по
+// позиции быстро находит формулы, диапазоны которых её покрывают.
+// Лист делится на тайлы (как в CellStorage), и формула записывается в
+// корзину каждого тайла, который задевают её диапазоны. Поиск - одна корзина
+// и проверка попадания в диапазон. Формулы, диапазоны которых задевают больше
+// LARGE_TILE_COUNT тайлов, хранятся отдельным списком и проверяются при каждом
+// поиске: так огромный диапазон не раздувает индекс.
+class RangeIndex {
+public:
+    static constexpr int TILE_SHIFT = 6;
+    static constexpr size_t LARGE_TILE_COUNT = 1024;
+
+    // Регистрирует формулу с её диапазонами (взамен прежних)
+    void Add(Cell* cell, const std::vector<Range>& ranges);
+
+    // Снимает формулу с учёта, если она была зарегистрирована
+    void Remove(Cell* cell);
+
+    bool IsEmpty() const {
+        return registered_.empty();
+    }
+
+    // Память корзин и списков индекса, в байтах
+    size_t GetMemoryBytes() const;
+
+    // Вызывает func(Cell*) для каждой формулы, какой-то диапазон которой
+    // содержит позицию; каждая формула - один раз
+    template <typename Func>
+    void ForEachCovering(Position pos, Func&& func) const {
+        if (registered_.empty()) {
+            return;
+        }
+        if (auto it = buckets_.find(TileKey(pos.row >> TILE_SHIFT, pos.col >> TILE_SHIFT)); it != buckets_.end()) {
+            VisitCovering(it->second, pos, func);
+        }
+        VisitCovering(large_, pos, func);
+    }
+
+private:
+    struct Entry {
+        Cell* cell;
+        Range range;
+    };
+
+    static int TileKey(int tile_row, int tile_col) {
+        return tile_row * (Position::MAX_COLS >> TILE_SHIFT) + tile_col;
+    }
+
+    // Записи одной формулы в списке идут подряд, поэтому повтор формулы
+    // (позиция внутри нескольких её диапазонов) отсекается сравнением с
+    // предыдущей найденной
+    template <typename Func>
+    static void VisitCovering(const std::vector<Entry>& entries, Position pos, Func& func) {
+        const Cell* last = nullptr;
+        for (const Entry& entry : entries) {
+            if (entry.cell != last && entry.range.Contains(pos)) {
+                last = entry.cell;
+                func(entry.cell);
+            }
+        }
+    }
+
+    static size_t CountTiles(const std::vector<Range>& ranges);
+
+    // Обходит ключи тайлов, которые задевает диапазон
+    template <typename Func>
+    static void ForEachTile(const Range& range, Func&& func) {
+        for (int row = range.from.row >> TILE_SHIFT; row <= range.to.row >> TILE_SHIFT; ++row) {
+            for (int col = range.from.col >> TILE_SHIFT; col <= range.to.col >> TILE_SHIFT; ++col) {
+                func(TileKey(row, col));
+            }
+        }
+    }
+
+    std::unordered_map<int, std::vector<Entry>> buckets_;
+    std::vector<Entry> large_;
+    std::unordered_map<const Cell*, std::vector<Range>> registered_;
+};
@@ -0,0 +1,46 @@
+#include "read_write_mutex.h"
+
+void ReadWriteMutex::lock() {
+    std::unique_lock lock(mutex_);
+    waiting_writers_.fetch_add(1, std::memory_order_relaxed);
+    writers_wakeup_.wait(lock, [this] {
+        return !writer_ && readers_ == 0;
+    });
+    waiting_writers_.fetch_sub(1, std::memory_order_relaxed);
+    writer_ = true;
+}
+
+void ReadWriteMutex::unlock() {
+    bool writers_waiting = false;
+    {
+        std::lock_guard guard(mutex_);
+        writer_ = false;
+        writers_waiting = waiting_writers_.load(std::memory_order_relaxed) > 0;
+    }
+    // следующий писатель проходит раньше читателей; читатели проснутся,
+    // когда писателей не останется
+    if (writers_waiting) {
+        writers_wakeup_.notify_one();
+    } else {
+        readers_wakeup_.notify_all();
+    }
+}
+
+void ReadWriteMutex::lock_shared() {
+    std::unique_lock lock(mutex_);
+    readers_wakeup_.wait(lock, [this] {
+        return !writer_ && waiting_writers_.load(std::memory_order_relaxed) == 0;
+    });
+    ++readers_;
+}
+
+void ReadWriteMutex::unlock_shared() {
+    bool wake_writer = false;
+    {
+        std::lock_guard guard(mutex_);
+        wake_writer = --readers_ == 0 && waiting_writers_.load(std::memory_order_relaxed) > 0;
+    }
+    if (wake_writer) {
+        writers_wakeup_.notify_one();
+    }
+}
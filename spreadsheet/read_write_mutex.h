@@ -0,0 +1,41 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+// Мьютекс чтения-записи с приоритетом писателей: пока писатель ждёт,
+// новые читатели не входят, поэтому поток читателей не может задержать
+// изменение листа навсегда. Ожидание - на условных переменных, без
+// активного опроса. Подходит для std::shared_lock и std::unique_lock.
+//
+// Блокировку чтения нельзя брать повторно из потока, который уже её держит:
+// если между двумя захватами встанет писатель, второй захват будет ждать
+// писателя, а писатель - первого захвата.
+class ReadWriteMutex {
+public:
+    ReadWriteMutex() = default;
+    ReadWriteMutex(const ReadWriteMutex&) = delete;
+    ReadWriteMutex& operator=(const ReadWriteMutex&) = delete;
+
+    void lock();
+    void unlock();
+    void lock_shared();
+    void unlock_shared();
+
+    // Ждёт ли кто-нибудь блокировку записи. Проверка без блокировок: ею
+    // длинные операции под блокировкой чтения узнают, что пора уступить
+    bool HasWaitingWriters() const {
+        return waiting_writers_.load(std::memory_order_relaxed) > 0;
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable readers_wakeup_;
+    std::condition_variable writers_wakeup_;
+    size_t readers_ = 0;
+    bool writer_ = false;
+    // меняется под mutex_, атомарен ради HasWaitingWriters
+    std::atomic<size_t> waiting_writers_{0};
+};
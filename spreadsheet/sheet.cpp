@@ -1,48 +1,54 @@
 #include "sheet.h"
+#include "binary_io.h"
 #include "cell.h"
 #include "common.h"
 
 #include <algorithm>
-#include <functional>
+#include <cerrno>
+#include <charconv>
+#include <iterator>
+#include <exception>
+#include <fstream>
 #include <iostream>
 #include <optional>
 #include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
-using namespace std::literals;
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-Sheet::Sheet() {
-    // Инициализируем пустую таблицу
-    cells_.resize(1);
-    cells_[0].resize(1);
-}
+using namespace std::literals;
 
-Sheet::~Sheet() = default;
+Sheet::Sheet() = default;
 
-void Sheet::MaybeIncreaseSizeToIncludePosition(Position pos) {
-    ResizeIfNeeded(cells_, pos.row);
-    
-    if (pos.col >= 0) {
-        for (auto& row : cells_) {
-            ResizeIfNeeded(row, pos.col);
-        }
-    }
+Sheet::~Sheet() {
+    StopBackgroundRecalculation();
 }
 
 void Sheet::SetCell(Position pos, std::string text) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position");
     }
+    auto lock = LockForWriting();
 
-    MaybeIncreaseSizeToIncludePosition(pos);
-
-    Cell* cell = GetConcreteCell(pos);
+    Cell* cell = cells_.Get(pos);
     if (!cell) {
-        cells_[pos.row][pos.col] = std::make_unique<Cell>(*this);
-        cell = cells_[pos.row][pos.col].get();
+        cell = CreateCell(pos);
     }
 
+    const bool was_empty = cell->IsEmpty();
     try {
         cell->Set(std::move(text));
+        UpdatePrintableArea(pos, was_empty, cell->IsEmpty());
+        NoteChanged(pos);
     } catch (const CircularDependencyException&) {
         throw;
     } catch (const FormulaException&) {
@@ -52,113 +58,1158 @@ void Sheet::SetCell(Position pos, std::string text) {
     }
 }
 
-const CellInterface* Sheet::GetCell(Position pos) const {
-    if (!pos.IsValid()) {
-        throw InvalidPositionException("Invalid position");
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells, size_t parse_threads) {
+    auto lock = LockForWriting();
+
+    // повторы позиций: оставляем последнюю запись
+    std::stable_sort(cells.begin(), cells.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+
+    // Разбираем всё до первого изменения: ошибка в формуле не трогает лист
+    std::vector<std::pair<Position, Cell::Content>> contents;
+    ParseChanged(cells, parse_threads, contents);
+    ApplyContents(std::move(contents), true);
+}
+
+void Sheet::ParseChanged(std::vector<std::pair<Position, std::string>>& cells, size_t parse_threads,
+                         std::vector<std::pair<Position, Cell::Content>>& contents) {
+    for (const auto& [pos, text] : cells) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Invalid position");
+        }
+    }
+
+    std::vector<std::pair<Position, std::string>*> to_parse;
+    to_parse.reserve(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i) {
+        auto& [pos, text] = cells[i];
+        if (i + 1 < cells.size() && cells[i + 1].first == pos) {
+            continue;
+        }
+        const Cell* existing = cells_.Get(pos);
+        if (existing ? existing->GetTextRef() == text : text.empty()) {
+            continue;
+        }
+        to_parse.push_back(&cells[i]);
+    }
+    std::vector<std::optional<Cell::Content>> parsed = ParseContents(to_parse, parse_threads);
+
+    for (size_t i = 0; i < to_parse.size(); ++i) {
+        contents.emplace_back(to_parse[i]->first, std::move(*parsed[i]));
+    }
+}
+
+void Sheet::ApplyContents(std::vector<std::pair<Position, Cell::Content>> contents, bool invalidate) {
+    struct Entry {
+        Position pos;
+        Cell::Content content;  // новое содержимое, после записи - прежнее
+        Cell* cell = nullptr;
+        bool was_empty = true;
+    };
+
+    std::vector<Entry> entries;
+    entries.reserve(contents.size());
+    for (auto& [pos, content] : contents) {
+        entries.push_back({pos, std::move(content)});
+    }
+
+    std::vector<Position> created;
+    created_cells_ = &created;
+
+    // Сначала все ячейки отписываются от прежних источников, затем по одной
+    // подписываются на новые. Тогда в графе есть только рёбра итогового
+    // состояния, и найденный цикл - цикл итогового листа, а не промежуточного
+    for (Entry& entry : entries) {
+        entry.cell = cells_.Get(entry.pos);
+        if (!entry.cell) {
+            entry.cell = CreateCell(entry.pos);
+        }
+        entry.was_empty = entry.cell->IsEmpty();
+        entry.content = entry.cell->Replace(std::move(entry.content));
+    }
+
+    bool has_cycle = false;
+    for (Entry& entry : entries) {
+        if (!entry.cell->AttachSources()) {
+            has_cycle = true;
+            break;
+        }
+    }
+    created_cells_ = nullptr;
+
+    if (has_cycle) {
+        // Откат в том же порядке: вернуть прежнее содержимое всем, затем
+        // восстановить прежние рёбра (прежний граф ацикличен). Кэши не
+        // сбрасывались, поэтому остаются верными.
+        for (Entry& entry : entries) {
+            entry.content = entry.cell->Replace(std::move(entry.content));
+        }
+        for (Entry& entry : entries) {
+            entry.cell->AttachSources();
+        }
+        for (Position pos : created) {
+            const Cell* cell = cells_.Get(pos);
+            if (cell && cell->IsEmpty() && !cell->IsReferenced()) {
+                cells_.Erase(pos);
+            }
+        }
+        throw CircularDependencyException("Circular dependency detected");
+    }
+
+    std::vector<Cell*> changed;
+    changed.reserve(entries.size());
+    for (const Entry& entry : entries) {
+        changed.push_back(entry.cell);
+        UpdatePrintableArea(entry.pos, entry.was_empty, entry.cell->IsEmpty());
+        NoteChanged(entry.pos);
+    }
+    if (invalidate) {
+        Cell::InvalidateCachesDownstream(*this, changed);
+    } else {
+        Cell::PublishValues(changed);
+    }
+}
+
+std::vector<std::optional<Cell::Content>> Sheet::ParseContents(
+        const std::vector<std::pair<Position, std::string>*>& cells, size_t threads) {
+    // Разбор формул не меняет лист (общий кэш формул защищён сам), поэтому
+    // записи можно разбирать на нескольких потоках, каждый - свой отрезок
+    constexpr size_t MIN_CELLS_PER_THREAD = 1024;
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
     }
+    threads = std::max<size_t>(1, std::min(threads, cells.size() / MIN_CELLS_PER_THREAD));
 
-    if (pos.row >= static_cast<int>(cells_.size()) || 
-        pos.col >= static_cast<int>(cells_[pos.row].size())) {
-        return nullptr;
+    std::vector<std::optional<Cell::Content>> result(cells.size());
+    std::vector<std::exception_ptr> errors(threads);
+    auto parse = [&](size_t part) {
+        const size_t begin = cells.size() * part / threads;
+        const size_t end = cells.size() * (part + 1) / threads;
+        try {
+            for (size_t i = begin; i < end; ++i) {
+                auto& [pos, text] = *cells[i];
+                try {
+                    result[i].emplace(Cell::Parse(std::move(text), *this, pos));
+                } catch (const FormulaException&) {
+                    throw;
+                } catch (const std::exception& e) {
+                    throw FormulaException(std::string("Unknown formula error: ") + e.what());
+                }
+            }
+        } catch (...) {
+            errors[part] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (size_t part = 1; part < threads; ++part) {
+        workers.emplace_back(parse, part);
+    }
+    parse(0);
+    for (std::thread& worker : workers) {
+        worker.join();
     }
 
-    return cells_[pos.row][pos.col].get();
+    // первая по порядку ошибка - та же, что дал бы разбор на одном потоке
+    for (const std::exception_ptr& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    return result;
+}
+
+namespace {
+
+constexpr size_t TEXT_CHUNK_SIZE = 1 << 20;
+
+// Разбирает таблицу текстов (см. Sheet::LoadTexts) кусками: каждый кусок
+// делится на строки и поля без копирования. Текст непустой ячейки
+// копируется один раз, и эта копия становится текстом ячейки
+class TextTableReader {
+public:
+    explicit TextTableReader(char delimiter)
+        : delimiter_(delimiter) {}
+
+    // Разбирает целые строки из data и возвращает их общую длину. Неполная
+    // последняя строка остаётся до следующего куска, если кусок не последний
+    size_t Feed(std::string_view data, bool last) {
+        size_t consumed = 0;
+        while (consumed < data.size()) {
+            const size_t end = data.find('\n', consumed);
+            if (end == std::string_view::npos) {
+                if (last) {
+                    AddLine(data.substr(consumed));
+                    consumed = data.size();
+                }
+                break;
+            }
+            AddLine(data.substr(consumed, end - consumed));
+            consumed = end + 1;
+        }
+        return consumed;
+    }
+
+    // поля строк, разобранных с прошлого вызова
+    std::vector<std::pair<Position, std::string>> TakeCells() {
+        return std::move(cells_);
+    }
+
+private:
+    void AddLine(std::string_view line) {
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        int col = 0;
+        for (size_t start = 0;; ++col) {
+            const size_t end = line.find(delimiter_, start);
+            const std::string_view field = line.substr(start, end == std::string_view::npos ? end : end - start);
+            const Position pos{row_, col};
+            // пустое поле очищает ячейку; за границами листа очищать нечего,
+            // а непустое поле там отвергнет ParseChanged
+            if (!field.empty() || pos.IsValid()) {
+                cells_.emplace_back(pos, std::string(field));
+            }
+            if (end == std::string_view::npos) {
+                break;
+            }
+            start = end + 1;
+        }
+        ++row_;
+    }
+
+    char delimiter_;
+    int row_ = 0;
+    std::vector<std::pair<Position, std::string>> cells_;
+};
+
+}  // namespace
+
+void Sheet::LoadTexts(std::string_view data, char delimiter, size_t parse_threads) {
+    auto lock = LockForWriting();
+    TextTableReader reader(delimiter);
+    std::vector<std::pair<Position, Cell::Content>> contents;
+    // и здесь по кускам, чтобы тексты полей не копились до конца разбора
+    for (size_t begin = 0, size = TEXT_CHUNK_SIZE; begin < data.size();) {
+        const std::string_view chunk = data.substr(begin, size);
+        const size_t consumed = reader.Feed(chunk, begin + chunk.size() == data.size());
+        auto cells = reader.TakeCells();
+        ParseChanged(cells, parse_threads, contents);
+        begin += consumed;
+        // строка не уместилась в кусок - берём кусок вдвое больше
+        size = consumed == 0 ? size * 2 : TEXT_CHUNK_SIZE;
+    }
+    ApplyContents(std::move(contents), true);
+}
+
+void Sheet::LoadTexts(std::istream& input, char delimiter, size_t parse_threads) {
+    auto lock = LockForWriting();
+    TextTableReader reader(delimiter);
+    std::vector<std::pair<Position, Cell::Content>> contents;
+    std::string buffer;
+    while (input) {
+        const size_t kept = buffer.size();
+        buffer.resize(kept + TEXT_CHUNK_SIZE);
+        input.read(buffer.data() + kept, TEXT_CHUNK_SIZE);
+        buffer.resize(kept + static_cast<size_t>(input.gcount()));
+        buffer.erase(0, reader.Feed(buffer, !input));
+        auto cells = reader.TakeCells();
+        ParseChanged(cells, parse_threads, contents);
+    }
+    ApplyContents(std::move(contents), true);
+}
+
+// ================= Двоичный формат =================
+//
+// Заголовок: SAVE_MAGIC, версия формата.
+// Выражения: их число, затем каждое выражение (FormulaAST::Serialize) строкой.
+// Ячейки: их число, затем по возрастанию позиций: строка, столбец, вид ячейки;
+// у текста - сам текст, у формулы - номер выражения, сдвиг его ссылок
+// (см. FormulaCache) и значение формулы, если оно было готово.
+// Рёбра графа не хранятся: они строятся по ссылкам выражений без разбора.
+
+namespace {
+
+constexpr std::string_view SAVE_MAGIC = "SHTB"sv;
+constexpr std::uint32_t SAVE_VERSION = 1;
+
+enum class SavedCell : std::uint8_t {
+    TEXT,
+    FORMULA,
+};
+
+enum class SavedValue : std::uint8_t {
+    NONE,  // значение не было готово
+    NUMBER,
+    ERROR,
+};
+
+void WriteFormulaValue(std::string& out, const FormulaInterface::Value& value) {
+    if (const double* number = std::get_if<double>(&value)) {
+        WriteUint8(out, static_cast<std::uint8_t>(SavedValue::NUMBER));
+        WriteDouble(out, *number);
+    } else {
+        WriteUint8(out, static_cast<std::uint8_t>(SavedValue::ERROR));
+        WriteUint8(out, static_cast<std::uint8_t>(std::get<FormulaError>(value).GetCategory()));
+    }
+}
+
+std::optional<FormulaInterface::Value> ReadFormulaValue(BinaryReader& in) {
+    switch (static_cast<SavedValue>(in.ReadUint8())) {
+        case SavedValue::NONE:
+            return std::nullopt;
+        case SavedValue::NUMBER:
+            return in.ReadDouble();
+        case SavedValue::ERROR: {
+            const auto category = static_cast<FormulaError::Category>(in.ReadUint8());
+            if (category > FormulaError::Category::Arithmetic) {
+                throw BinaryFormatError("Invalid formula error");
+            }
+            return FormulaError(category);
+        }
+    }
+    throw BinaryFormatError("Invalid formula value");
+}
+
+Position ReadPosition(BinaryReader& in) {
+    const int row = in.ReadInt32();
+    return {row, in.ReadInt32()};
+}
+
+// Ссылки выражения, сдвинутые на offset, не выходят за пределы листа
+bool IsValidShift(const FormulaAST& ast, Position offset) {
+    for (Position cell : ast.GetReferencedCells()) {
+        if (!ShiftPosition(cell, offset).IsValid()) {
+            return false;
+        }
+    }
+    for (const Range& range : ast.GetReferencedRanges()) {
+        if (!ShiftRange(range, offset).IsValid()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Файл, отображённый в память только для чтения. Где отображения нет, файл
+// читается в память целиком
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+#if defined(__unix__) || defined(__APPLE__)
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot open " + path);
+        }
+        struct stat info {};
+        if (::fstat(fd, &info) != 0) {
+            const int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "Cannot open " + path);
+        }
+        size_ = static_cast<size_t>(info.st_size);
+        if (size_ > 0) {
+            void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                const int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), "Cannot map " + path);
+            }
+            data_ = static_cast<const char*>(data);
+        }
+        ::close(fd);
+#else
+        std::ifstream input(path, std::ios::binary);
+        if (!input) {
+            throw std::system_error(std::make_error_code(std::errc::no_such_file_or_directory),
+                                    "Cannot open " + path);
+        }
+        copy_.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+        data_ = copy_.data();
+        size_ = copy_.size();
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (data_) {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+#endif
+    }
+
+    std::string_view GetData() const {
+        return {data_, size_};
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#if !defined(__unix__) && !defined(__APPLE__)
+    std::string copy_;
+#endif
+};
+
+}  // namespace
+
+void Sheet::Save(std::ostream& output) const {
+    std::vector<std::pair<Position, const Cell*>> cells;
+    cells.reserve(cells_.GetCellCount());
+    cells_.ForEach([&cells](Position pos, const Cell& cell) {
+        if (!cell.IsEmpty()) {
+            cells.emplace_back(pos, &cell);
+        }
+    });
+    std::sort(cells.begin(), cells.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+
+    // общее выражение сохраняется один раз
+    std::unordered_map<const FormulaAST*, std::uint32_t> template_ids;
+    std::string templates;
+    std::string records;
+    for (const auto& [pos, cell] : cells) {
+        WriteInt32(records, pos.row);
+        WriteInt32(records, pos.col);
+        const FormulaInterface* formula = cell->GetFormula();
+        if (!formula) {
+            WriteUint8(records, static_cast<std::uint8_t>(SavedCell::TEXT));
+            WriteString(records, cell->GetTextRef());
+            continue;
+        }
+
+        WriteUint8(records, static_cast<std::uint8_t>(SavedCell::FORMULA));
+        const FormulaAST* ast = formula->GetAST().get();
+        auto [it, inserted] = template_ids.emplace(ast, static_cast<std::uint32_t>(template_ids.size()));
+        if (inserted) {
+            std::string tree;
+            ast->Serialize(tree);
+            WriteString(templates, tree);
+        }
+        WriteUint32(records, it->second);
+        WriteInt32(records, formula->GetOffset().row);
+        WriteInt32(records, formula->GetOffset().col);
+        if (cell->IsDirty()) {
+            WriteUint8(records, static_cast<std::uint8_t>(SavedValue::NONE));
+        } else {
+            WriteFormulaValue(records, cell->GetNumericValue());
+        }
+    }
+
+    std::string header(SAVE_MAGIC);
+    WriteUint32(header, SAVE_VERSION);
+    WriteUint32(header, static_cast<std::uint32_t>(template_ids.size()));
+    output.write(header.data(), header.size());
+    output.write(templates.data(), templates.size());
+    std::string count;
+    WriteUint32(count, static_cast<std::uint32_t>(cells.size()));
+    output.write(count.data(), count.size());
+    output.write(records.data(), records.size());
+}
+
+void Sheet::Load(std::string_view data) {
+    BinaryReader in(data);
+    if (in.Take(SAVE_MAGIC.size()) != SAVE_MAGIC) {
+        throw BinaryFormatError("Not a saved sheet");
+    }
+    if (in.ReadUint32() != SAVE_VERSION) {
+        throw BinaryFormatError("Unsupported sheet format version");
+    }
+
+    // у каждого шаблона есть хотя бы длина, так что больший счётчик - порча
+    // данных, а не повод выделять под него память
+    const std::uint32_t template_count = in.ReadUint32();
+    if (template_count > in.GetRemainingSize() / 4) {
+        throw BinaryFormatError("Invalid formula count");
+    }
+    std::vector<std::shared_ptr<const FormulaAST>> templates(template_count);
+    for (auto& ast : templates) {
+        BinaryReader tree(in.ReadString());
+        ast = std::make_shared<const FormulaAST>(FormulaAST::Deserialize(tree));
+        if (!tree.AtEnd()) {
+            throw BinaryFormatError("Invalid formula");
+        }
+    }
+
+    auto lock = LockForWriting();
+
+    // в пустом листе сохранённые значения формул верны: все их источники
+    // загружаются вместе с ними
+    const bool keep_values = cells_.GetCellCount() == 0;
+
+    const std::uint32_t count = in.ReadUint32();
+    std::vector<std::pair<Position, Cell::Content>> contents;
+    contents.reserve(std::min<size_t>(count, data.size()));
+    for (std::uint32_t i = 0; i < count; ++i) {
+        const Position pos = ReadPosition(in);
+        if (!pos.IsValid() || (!contents.empty() && !(contents.back().first < pos))) {
+            throw BinaryFormatError("Invalid cell position");
+        }
+
+        switch (static_cast<SavedCell>(in.ReadUint8())) {
+            case SavedCell::TEXT: {
+                std::string text(in.ReadString());
+                if (!text.empty() && text[0] == FORMULA_SIGN && text.size() > 1) {
+                    throw BinaryFormatError("Formula saved as text");
+                }
+                contents.emplace_back(pos, Cell::Parse(std::move(text), *this, pos));
+                break;
+            }
+            case SavedCell::FORMULA: {
+                const std::uint32_t id = in.ReadUint32();
+                const Position offset = ReadPosition(in);
+                auto value = ReadFormulaValue(in);
+                if (id >= templates.size() || !IsValidShift(*templates[id], offset)) {
+                    throw BinaryFormatError("Invalid formula reference");
+                }
+                contents.emplace_back(pos, Cell::FromFormula(MakeFormula(templates[id], offset), *this,
+                                                             keep_values ? std::move(value) : std::nullopt));
+                break;
+            }
+            default:
+                throw BinaryFormatError("Invalid cell kind");
+        }
+    }
+    if (!in.AtEnd()) {
+        throw BinaryFormatError("Unexpected data after the cells");
+    }
+
+    ApplyContents(std::move(contents), !keep_values);
+}
+
+void Sheet::LoadMapped(const std::string& path) {
+    MappedFile file(path);
+    Load(file.GetData());
+}
+
+const CellInterface* Sheet::GetCell(Position pos) const {
+    return GetConcreteCell(pos);
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
-    return const_cast<CellInterface*>(
-        static_cast<const Sheet&>(*this).GetCell(pos)
-    );
+    return GetConcreteCell(pos);
 }
 
 const Cell* Sheet::GetConcreteCell(Position pos) const {
-    return dynamic_cast<const Cell*>(GetCell(pos));
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+
+    return cells_.Get(pos);
 }
 
 Cell* Sheet::GetConcreteCell(Position pos) {
-    return dynamic_cast<Cell*>(GetCell(pos));
+    return const_cast<Cell*>(
+        static_cast<const Sheet&>(*this).GetConcreteCell(pos)
+    );
+}
+
+Cell* Sheet::CreateCell(Position pos) {
+    if (created_cells_) {
+        created_cells_->push_back(pos);
+    }
+    NoteChanged(pos);
+    return cells_.Emplace(pos, *this, pos);
 }
 
 void Sheet::ClearCell(Position pos) {
+    auto lock = LockForWriting();
     Cell* cell = GetConcreteCell(pos);
     if (!cell) return;
 
-    if (cell->IsReferenced()) {
-        // Кто-то ссылается → превращаем в пустую клетку
-        cell->Clear();
-    } else {
+    UpdatePrintableArea(pos, cell->IsEmpty(), true);
+    NoteChanged(pos);
+
+    // Очищаем в любом случае: ячейка должна отписаться от своих источников
+    cell->Clear();
+    if (!cell->IsReferenced()) {
         // Никто не ссылается → удаляем объект полностью
-        cells_[pos.row][pos.col].reset();
+        cells_.Erase(pos);
     }
 }
 
-Size Sheet::GetActualSize() const {
-    int max_row = -1;
-    int max_col = -1;
+void Sheet::RecalculateAll(size_t threads) {
+    // промахи кэша у читателей ждут окончания пересчёта
+    std::lock_guard guard(recalculation_mutex_);
 
-    for (int row = 0; row < static_cast<int>(cells_.size()); ++row) {
-        for (int col = 0; col < static_cast<int>(cells_[row].size()); ++col) {
-            if (cells_[row][col] && !cells_[row][col]->GetText().empty()) {
-                max_row = std::max(max_row, row);
-                max_col = std::max(max_col, col);
+    std::vector<const Cell*> dirty;
+    cells_.ForEach([&dirty](Position, const Cell& cell) {
+        if (cell.IsDirty()) {
+            dirty.push_back(&cell);
+        }
+    });
+    Cell::RecalculateInParallel(std::move(dirty), threads);
+}
+
+std::shared_lock<ReadWriteMutex> Sheet::LockForReading() const {
+    return std::shared_lock(access_mutex_);
+}
+
+std::unique_lock<ReadWriteMutex> Sheet::LockForWriting() {
+    std::unique_lock lock(access_mutex_);
+    DropUnusedSnapshotState();
+
+    // лист сейчас изменится - фоновый пересчёт начнёт заново
+    if (worker_.joinable()) {
+        {
+            std::lock_guard guard(worker_mutex_);
+            worker_generation_.fetch_add(1, std::memory_order_relaxed);
+        }
+        worker_wakeup_.notify_one();
+    }
+    return lock;
+}
+
+void Sheet::StartBackgroundRecalculation() {
+    if (worker_.joinable()) {
+        return;
+    }
+    worker_stop_ = false;
+    // первый проход - сразу, не дожидаясь изменений
+    worker_generation_.fetch_add(1, std::memory_order_relaxed);
+    worker_ = std::thread([this] {
+        RunBackgroundRecalculation();
+    });
+}
+
+void Sheet::StopBackgroundRecalculation() {
+    if (!worker_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard guard(worker_mutex_);
+        worker_stop_ = true;
+    }
+    worker_wakeup_.notify_one();
+    worker_.join();
+}
+
+void Sheet::SetViewport(std::optional<Range> viewport) {
+    if (viewport && !viewport->IsValid()) {
+        throw InvalidPositionException("Invalid viewport");
+    }
+    {
+        std::lock_guard guard(worker_mutex_);
+        viewport_ = viewport;
+        worker_generation_.fetch_add(1, std::memory_order_relaxed);
+    }
+    worker_wakeup_.notify_one();
+}
+
+void Sheet::RunBackgroundRecalculation() {
+    uint64_t generation = 0;
+    for (;;) {
+        std::optional<Range> viewport;
+        {
+            std::unique_lock lock(worker_mutex_);
+            worker_wakeup_.wait(lock, [&] {
+                return worker_stop_ || worker_generation_.load(std::memory_order_relaxed) != generation;
+            });
+            if (worker_stop_) {
+                return;
+            }
+            generation = worker_generation_.load(std::memory_order_relaxed);
+            viewport = viewport_;
+        }
+
+        // Прерываемся, как только писатель ждёт блокировку, сменилась
+        // область просмотра или поток останавливают. Писатель, получив
+        // блокировку, увеличит номер поколения, и проход начнётся заново
+        const auto read_lock = LockForReading();
+        auto interrupted = [&] {
+            return access_mutex_.HasWaitingWriters() || worker_stop_.load(std::memory_order_relaxed)
+                   || worker_generation_.load(std::memory_order_relaxed) != generation;
+        };
+        auto recalculate = [&](const Range& range) {
+            bool stopped = false;
+            ForEachCellInRange(range, [&](const Cell& cell) {
+                if (stopped || !cell.IsDirty()) {
+                    return;
+                }
+                if (interrupted()) {
+                    stopped = true;
+                    return;
+                }
+                cell.Recalculate();
+            });
+            return !stopped;
+        };
+
+        if (viewport && !recalculate(*viewport)) {
+            continue;
+        }
+        // остальной лист - полосами по строкам тайлов, чтобы вовремя
+        // замечать писателей и между обходами хранилища
+        const Size size = GetPrintableSize();
+        for (int row = 0; row < size.rows; row += CellStorage::TILE_SIZE) {
+            const int last_row = std::min(row + CellStorage::TILE_SIZE, size.rows) - 1;
+            if (interrupted() || !recalculate({{row, 0}, {last_row, size.cols - 1}})) {
+                break;
             }
         }
     }
+}
 
-    return {
-        max_row >= 0 ? max_row + 1 : 0,
-        max_col >= 0 ? max_col + 1 : 0
-    };
+Cell::KnownValue Sheet::TryGetValue(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    const Cell* cell = cells_.Get(pos);
+    if (!cell) {
+        return {CellInterface::Value(0.0), false};
+    }
+    return cell->TryGetValue();
+}
+
+uint64_t Sheet::StartTraversal() {
+    traversal_buffers_.stack.clear();
+    return ++traversal_epoch_;
+}
+
+void Sheet::NonEmptyCounter::Add(int index) {
+    if (index >= static_cast<int>(counts_.size())) {
+        counts_.resize(index + 1);
+    }
+    ++counts_[index];
+    bound_ = std::max(bound_, index + 1);
+}
+
+void Sheet::NonEmptyCounter::Remove(int index) {
+    if (--counts_[index] > 0 || index + 1 != bound_) {
+        return;
+    }
+    // опустела крайняя линия: отступаем до ближайшей непустой
+    while (bound_ > 0 && counts_[bound_ - 1] == 0) {
+        --bound_;
+    }
+}
+
+void Sheet::UpdatePrintableArea(Position pos, bool was_empty, bool is_empty) {
+    if (was_empty == is_empty) {
+        return;
+    }
+    if (was_empty) {
+        row_counter_.Add(pos.row);
+        col_counter_.Add(pos.col);
+    } else {
+        row_counter_.Remove(pos.row);
+        col_counter_.Remove(pos.col);
+    }
 }
 
 Size Sheet::GetPrintableSize() const {
-    return GetActualSize();
+    return {row_counter_.GetBound(), col_counter_.GetBound()};
 }
 
-void Sheet::PrintCells(std::ostream& output,
-                       const std::function<void(const CellInterface&)>& printCell) const {
-    Size size = GetPrintableSize();
-    
-    for (int row = 0; row < size.rows; ++row) {
-        for (int col = 0; col < size.cols; ++col) {
-            if (col > 0) {
-                output << '\t';
+namespace {
+
+// Буфер печати сбрасывается в поток, когда набирает столько байт
+constexpr size_t PRINT_FLUSH_SIZE = 1 << 20;
+
+// Печатает строки [first_row, last_row) таблицы шириной cols в buffer.
+// find_tile(tile_row, tile_col) возвращает тайл (с массивом cells, как у
+// CellStorage::Tile) или nullptr; print_cell(buffer, cell) дописывает
+// непустую ячейку. Для отсутствующего тайла сразу пишутся все его
+// разделители. Общая для листа и его снимков
+template <typename FindTile, typename PrintCell>
+void PrintRows(std::string& buffer, int first_row, int last_row, int cols,
+               FindTile find_tile, PrintCell print_cell) {
+    const int tile_cols = (cols + CellStorage::TILE_MASK) >> CellStorage::TILE_SHIFT;
+    std::vector<decltype(find_tile(0, 0))> tiles(tile_cols);
+    for (int row = first_row; row < last_row; ++row) {
+        if (row == first_row || (row & CellStorage::TILE_MASK) == 0) {
+            for (int tile_col = 0; tile_col < tile_cols; ++tile_col) {
+                tiles[tile_col] = find_tile(row >> CellStorage::TILE_SHIFT, tile_col);
             }
-            const CellInterface* cell = nullptr;
-            if (row < static_cast<int>(cells_.size()) && 
-                col < static_cast<int>(cells_[row].size())) {
-                cell = cells_[row][col].get();
+        }
+        for (int tile_col = 0; tile_col < tile_cols; ++tile_col) {
+            const int col_begin = tile_col << CellStorage::TILE_SHIFT;
+            const int col_end = std::min(cols, col_begin + CellStorage::TILE_SIZE);
+            const auto* tile = tiles[tile_col];
+            if (!tile) {
+                buffer.append(col_end - col_begin - (col_begin == 0 ? 1 : 0), '\t');
+                continue;
             }
-            
-            // Выводим только ячейки с непустым текстом
-            if (cell && !cell->GetText().empty()) {
-                printCell(*cell);
+            for (int col = col_begin; col < col_end; ++col) {
+                if (col > 0) {
+                    buffer.push_back('\t');
+                }
+                // Пустые ячейки (nullptr или с пустым текстом) не выводятся
+                const auto& cell = tile->cells[CellStorage::IndexInTile({row, col})];
+                if (cell && !cell->IsEmpty()) {
+                    print_cell(buffer, *cell);
+                }
             }
-            // Пустые ячейки (nullptr или с пустым текстом) не выводятся
         }
-        output << '\n';
+        buffer.push_back('\n');
     }
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-    PrintCells(output, [&output](const CellInterface& cell) {
-        auto val = cell.GetValue();
-        if (std::holds_alternative<double>(val)) {
-            output << std::get<double>(val);
-        } else if (std::holds_alternative<FormulaError>(val)) {
-            output << std::get<FormulaError>(val);
-        } else {
-            output << std::get<std::string>(val);
+// Печать таблицы size блоками по TILE_SIZE строк (см. PrintRows). При
+// threads > 1 запускается threads рабочих потоков; каждый берёт следующий
+// блок из общего счётчика и печатает его в буфер блока. Вызывающий поток
+// выводит готовые блоки по порядку, как только готов очередной. Буферов
+// вдвое больше, чем потоков, и они переиспользуются: поток не берётся за
+// блок, пока его буфер не выведен
+template <typename FindTile, typename PrintCell>
+void PrintCells(std::ostream& output, Size size, size_t threads,
+                FindTile find_tile, PrintCell print_cell) {
+    if (size.rows <= 0 || size.cols <= 0) {
+        return;
+    }
+    const size_t blocks = (size.rows + CellStorage::TILE_MASK) >> CellStorage::TILE_SHIFT;
+    auto print_block = [&](std::string& buffer, size_t block) {
+        const int first_row = static_cast<int>(block) << CellStorage::TILE_SHIFT;
+        const int last_row = std::min(size.rows, first_row + CellStorage::TILE_SIZE);
+        PrintRows(buffer, first_row, last_row, size.cols, find_tile, print_cell);
+    };
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, blocks);
+
+    if (threads == 1) {
+        std::string buffer;
+        buffer.reserve(PRINT_FLUSH_SIZE + PRINT_FLUSH_SIZE / 4);
+        for (size_t block = 0; block < blocks; ++block) {
+            print_block(buffer, block);
+            if (buffer.size() >= PRINT_FLUSH_SIZE) {
+                output.write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
         }
-    });
+        output.write(buffer.data(), buffer.size());
+        return;
+    }
+
+    const size_t window = 2 * threads;
+    std::vector<std::string> buffers(window);
+    std::atomic<size_t> next_block{0};
+
+    // под mutex: готовность буферов и число выведенных блоков
+    std::mutex mutex;
+    std::condition_variable block_ready;
+    std::condition_variable buffer_free;
+    std::vector<char> ready(window, false);
+    size_t written = 0;
+
+    auto work = [&] {
+        for (;;) {
+            const size_t block = next_block.fetch_add(1, std::memory_order_relaxed);
+            if (block >= blocks) {
+                return;
+            }
+            {
+                std::unique_lock lock(mutex);
+                buffer_free.wait(lock, [&] {
+                    return block < written + window;
+                });
+            }
+            print_block(buffers[block % window], block);
+            {
+                std::lock_guard guard(mutex);
+                ready[block % window] = true;
+            }
+            block_ready.notify_one();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back(work);
+    }
+    for (size_t block = 0; block < blocks; ++block) {
+        std::string& buffer = buffers[block % window];
+        {
+            std::unique_lock lock(mutex);
+            block_ready.wait(lock, [&] {
+                return ready[block % window];
+            });
+        }
+        output.write(buffer.data(), buffer.size());
+        buffer.clear();
+        {
+            std::lock_guard guard(mutex);
+            ready[block % window] = false;
+            ++written;
+        }
+        buffer_free.notify_all();
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+// Число в том же виде, что и std::ostream по умолчанию (%g, точность 6),
+// но без обращения к локали потока
+void AppendNumber(std::string& buffer, double value) {
+    char chars[32];
+    const auto result = std::to_chars(std::begin(chars), std::end(chars), value,
+                                      std::chars_format::general, 6);
+    buffer.append(chars, result.ptr);
+}
+
+void AppendValue(std::string& buffer, const CellInterface::Value& val) {
+    if (std::holds_alternative<double>(val)) {
+        AppendNumber(buffer, std::get<double>(val));
+    } else if (std::holds_alternative<FormulaError>(val)) {
+        buffer += std::get<FormulaError>(val).ToString();
+    } else {
+        buffer += std::get<std::string>(val);
+    }
+}
+
+}  // namespace
+
+void Sheet::PrintValues(std::ostream& output) const {
+    PrintValues(output, 1);
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
-    PrintCells(output, [&output](const CellInterface& cell) {
-        output << cell.GetText();
+    PrintTexts(output, 1);
+}
+
+void Sheet::PrintValues(std::ostream& output, size_t threads) const {
+    auto find_tile = [this](int tile_row, int tile_col) {
+        return cells_.FindTile(tile_row, tile_col);
+    };
+    PrintCells(output, GetPrintableSize(), threads, find_tile, [](std::string& buffer, const Cell& cell) {
+        AppendValue(buffer, cell.GetValue());
+    });
+}
+
+void Sheet::PrintTexts(std::ostream& output, size_t threads) const {
+    auto find_tile = [this](int tile_row, int tile_col) {
+        return cells_.FindTile(tile_row, tile_col);
+    };
+    PrintCells(output, GetPrintableSize(), threads, find_tile, [](std::string& buffer, const Cell& cell) {
+        buffer += cell.GetTextRef();
     });
 }
 
+
+// ================= Снимки =================
+
+// Ячейка снимка: всё, что о ней можно узнать через CellInterface
+struct Sheet::FrozenCell : public CellInterface {
+    FrozenCell(const Cell& cell)
+        : value(cell.GetValue())
+        , text(cell.GetTextRef())
+        , refs(cell.GetReferencedCells()) {}
+
+    Value GetValue() const override {
+        return value;
+    }
+
+    std::string GetText() const override {
+        return text;
+    }
+
+    const std::vector<Position>& GetReferencedCells() const override {
+        return refs;
+    }
+
+    bool IsEmpty() const {
+        return text.empty();
+    }
+
+    size_t GetHeapBytes() const {
+        const auto* str = std::get_if<std::string>(&value);
+        return sizeof(*this) + StringHeapBytes(text) + VectorHeapBytes(refs) + (str ? StringHeapBytes(*str) : 0);
+    }
+
+    Value value;
+    std::string text;
+    std::vector<Position> refs;
+};
+
+class Sheet::SnapshotSheet : public SheetInterface {
+public:
+    SnapshotSheet(std::shared_ptr<const FrozenImage> image, Size size)
+        : image_(std::move(image))
+        , size_(size) {}
+
+    void SetCell(Position, std::string) override {
+        throw std::logic_error("Sheet snapshot is read-only");
+    }
+
+    void ClearCell(Position) override {
+        throw std::logic_error("Sheet snapshot is read-only");
+    }
+
+    const CellInterface* GetCell(Position pos) const override {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Invalid position");
+        }
+        return Find(pos);
+    }
+
+    CellInterface* GetCell(Position pos) override {
+        // ячейки снимка не изменяются: у CellInterface только константные методы
+        return const_cast<FrozenCell*>(static_cast<const FrozenCell*>(
+            static_cast<const SnapshotSheet&>(*this).GetCell(pos)));
+    }
+
+    Size GetPrintableSize() const override {
+        return size_;
+    }
+
+    void PrintValues(std::ostream& output) const override {
+        auto find_tile = [this](int tile_row, int tile_col) {
+            return FindTile(tile_row, tile_col);
+        };
+        PrintCells(output, size_, 1, find_tile, [](std::string& buffer, const FrozenCell& cell) {
+            AppendValue(buffer, cell.value);
+        });
+    }
+
+    void PrintTexts(std::ostream& output) const override {
+        auto find_tile = [this](int tile_row, int tile_col) {
+            return FindTile(tile_row, tile_col);
+        };
+        PrintCells(output, size_, 1, find_tile, [](std::string& buffer, const FrozenCell& cell) {
+            buffer += cell.text;
+        });
+    }
+
+private:
+    const FrozenTile* FindTile(int tile_row, int tile_col) const {
+        const auto& row = (*image_)[tile_row];
+        return row ? (*row)[tile_col].get() : nullptr;
+    }
+
+    const FrozenCell* Find(Position pos) const {
+        const FrozenTile* tile = FindTile(pos.row >> CellStorage::TILE_SHIFT, pos.col >> CellStorage::TILE_SHIFT);
+        if (!tile) {
+            return nullptr;
+        }
+        return tile->cells[CellStorage::IndexInTile(pos)].get();
+    }
+
+    std::shared_ptr<const FrozenImage> image_;
+    Size size_;
+};
+
+std::shared_ptr<const SheetInterface> Sheet::Snapshot() {
+    std::lock_guard guard(snapshot_mutex_);
+
+    if (!track_changes_) {
+        // живых снимков нет: замораживаем лист целиком, дальше - только изменения
+        track_changes_ = true;
+        cells_.ForEach([this](Position pos, const Cell&) {
+            Freeze(pos);
+        });
+    }
+
+    for (const auto& [key, changed] : changed_tiles_) {
+        const int row = (key / CellStorage::TILE_COLS) << CellStorage::TILE_SHIFT;
+        const int col = (key % CellStorage::TILE_COLS) << CellStorage::TILE_SHIFT;
+        for (int i = 0; i < CellStorage::TILE_CELLS; ++i) {
+            if (changed[i]) {
+                Freeze({row + (i >> CellStorage::TILE_SHIFT), col + (i & CellStorage::TILE_MASK)});
+            }
+        }
+    }
+    changed_tiles_.clear();
+
+    auto image = std::make_shared<const FrozenImage>(frozen_);
+    last_image_ = image;
+    return std::make_shared<SnapshotSheet>(std::move(image), GetPrintableSize());
+}
+
+void Sheet::DropUnusedSnapshotState() {
+    // Зовётся писателем: Snapshot() идёт под блокировкой чтения и сюда не
+    // попадёт. Более старые снимки могут быть живы, но они владеют своими
+    // узлами сами; следующий снимок просто заморозит лист целиком
+    if (track_changes_ && last_image_.expired()) {
+        track_changes_ = false;
+        frozen_ = {};
+        changed_tiles_ = {};
+    }
+}
+
+void Sheet::Freeze(Position pos) {
+    // Узел, разделённый со снимками (use_count > 1), перед изменением
+    // копируется. Счётчик могут только уменьшать другие потоки (снимки
+    // удаляются), так что ошибиться можно лишь в сторону лишней копии.
+    auto& row = frozen_[pos.row >> CellStorage::TILE_SHIFT];
+    if (!row) {
+        row = std::make_shared<FrozenRow>();
+    } else if (row.use_count() > 1) {
+        row = std::make_shared<FrozenRow>(*row);
+    }
+
+    auto& tile = (*row)[pos.col >> CellStorage::TILE_SHIFT];
+    if (!tile) {
+        tile = std::make_shared<FrozenTile>();
+    } else if (tile.use_count() > 1) {
+        tile = std::make_shared<FrozenTile>(*tile);
+    }
+
+    const Cell* cell = cells_.Get(pos);
+    tile->cells[CellStorage::IndexInTile(pos)] = cell ? std::make_shared<const FrozenCell>(*cell) : nullptr;
+}
+
+void Sheet::EnableStats(bool enabled) {
+    stats_.SetEnabled(enabled);
+}
+
+void Sheet::ResetStats() {
+    stats_.Reset();
+}
+
+SheetStatsReport Sheet::GetStats() const {
+    SheetStatsReport report;
+    stats_.Collect(report);
+
+    report.live_cells = cells_.GetCellCount();
+    std::unordered_set<const FormulaAST*> asts;
+    cells_.ForEach([&report, &asts](Position, const Cell& cell) {
+        report.edges += cell.GetSourceCount();
+        report.memory.edges += cell.GetEdgeHeapBytes();
+        report.memory.contents += cell.GetContentHeapBytes();
+        if (const FormulaInterface* formula = cell.GetFormula()) {
+            const FormulaAST* ast = formula->GetAST().get();
+            if (asts.insert(ast).second) {
+                report.memory.formulas += sizeof(FormulaAST) + ast->GetHeapBytes();
+            }
+        }
+    });
+    report.memory.tiles = cells_.GetTileBytes();
+    report.memory.cell_pool = cells_.GetPoolBytes();
+    report.memory.formula_cache = formula_cache_.GetMemoryBytes();
+    report.memory.range_index = range_index_.GetMemoryBytes();
+
+    // узлы копии общие со снимками, но держит их и сам лист
+    std::lock_guard guard(snapshot_mutex_);
+    report.memory.snapshots = track_changes_ ? HashMapBytes(changed_tiles_) : 0;
+    for (const auto& row : frozen_) {
+        if (!row) {
+            continue;
+        }
+        report.memory.snapshots += sizeof(FrozenRow);
+        for (const auto& tile : *row) {
+            if (!tile) {
+                continue;
+            }
+            report.memory.snapshots += sizeof(FrozenTile);
+            for (const auto& cell : tile->cells) {
+                if (cell) {
+                    report.memory.snapshots += cell->GetHeapBytes();
+                }
+            }
+        }
+    }
+    return report;
+}
+
 std::unique_ptr<SheetInterface> CreateSheet() {
     return std::make_unique<Sheet>();
 }
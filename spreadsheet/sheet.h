@@ -1,11 +1,40 @@
 #pragma once
 
 #include "cell.h"
+#include "cell_storage.h"
 #include "common.h"
+#include "range_index.h"
+#include "read_write_mutex.h"
+#include "sheet_stats.h"
 
-#include <functional>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <iosfwd>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 
+// Многопоточный доступ. Изменяющие методы (SetCell, SetCells, ClearCell)
+// сами берут лист монопольно. Читатели держат блокировку LockForReading() всё
+// время, пока работают с ячейками: под ней любое число потоков может вызывать
+// GetCell, GetValue, GetText, Print* и RecalculateAll. Готовые значения формул
+// читаются без блокировок; если кэш устарел, формулу вычисляет один поток, а
+// остальные ждут его результата. Изменять лист, держа блокировку чтения,
+// нельзя; брать её повторно в том же потоке тоже нельзя - при ждущем
+// писателе это взаимоблокировка (см. ReadWriteMutex). Snapshot() даёт
+// неизменяемую копию листа, с которой можно работать без блокировок, пока
+// лист продолжают изменять.
 class Sheet : public SheetInterface {
 public:
     Sheet();
@@ -13,6 +42,45 @@ public:
 
     void SetCell(Position pos, std::string text) override;  // Проверка циклических зависимостей происходит в методе Cell::Set
 
+    // Записывает несколько ячеек как одно изменение: граф перестраивается только
+    // для затронутых ячеек, циклы ищутся в итоговом состоянии листа, кэши
+    // сбрасываются одним обходом. Если позиция встречается несколько раз,
+    // действует последняя запись. При ошибке (неверная позиция, ошибка в
+    // формуле, цикл) лист остаётся прежним. Формулы разбираются на
+    // parse_threads потоках (0 - по числу ядер).
+    void SetCells(std::vector<std::pair<Position, std::string>> cells, size_t parse_threads = 1);
+
+    // Загружает таблицу текстов в том виде, в каком её печатает PrintTexts:
+    // строки разделены '\n' (допускается "\r\n"), ячейки - delimiter ('\t',
+    // для CSV - ','), пустое поле - пустая ячейка. Таблица кладётся начиная с
+    // A1 и записывается одним пакетом, как в SetCells: ячейки под полями
+    // заменяются (пустые поля их очищают), остальные ячейки листа не
+    // меняются. Данные читаются кусками, и ячейки куска разбираются сразу:
+    // кроме разобранных ячеек, в памяти держится только текущий кусок. Лист
+    // заблокирован для записи всё время загрузки. Кавычки CSV не
+    // поддерживаются, как и в PrintTexts, где текст ячейки не может содержать
+    // разделителей.
+    void LoadTexts(std::istream& input, char delimiter = '\t', size_t parse_threads = 1);
+    void LoadTexts(std::string_view data, char delimiter = '\t', size_t parse_threads = 1);
+
+    // Сохраняет лист в двоичном формате: тексты ячеек и разобранные формулы
+    // (выражение, общее для нескольких формул, - один раз), а также готовые
+    // значения формул. Для многопоточного доступа это чтение.
+    void Save(std::ostream& output) const;
+
+    // Загружает лист, сохранённый Save, не разбирая формул: выражения
+    // восстанавливаются из двоичного вида, граф зависимостей строится по их
+    // ссылкам. Ячейки записываются одним пакетом, как в SetCells. Если лист
+    // был пуст, сохранённые значения формул сразу готовы и ничего не
+    // пересчитывается. Повреждённые данные - BinaryFormatError. Если
+    // загруженные формулы вместе с остальными ячейками листа образуют цикл
+    // (или цикл записан в повреждённых данных) - CircularDependencyException.
+    // При любой ошибке лист не меняется.
+    void Load(std::string_view data);
+
+    // То же для файла; файл отображается в память и не копируется целиком
+    void LoadMapped(const std::string& path);
+
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
@@ -23,22 +91,242 @@ public:
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    // То же, но строки готовятся блоками по CellStorage::TILE_SIZE на threads
+    // потоках (0 - по числу ядер) и выводятся по порядку. Формулы с
+    // устаревшим кэшем вычисляются при печати; чтобы потоки не ждали друг
+    // друга, перед печатью стоит вызвать RecalculateAll.
+    void PrintValues(std::ostream& output, size_t threads) const;
+    void PrintTexts(std::ostream& output, size_t threads) const;
+
+    // Пересчитывает все формулы с устаревшим кэшем на threads потоках
+    // (0 - по числу ядер). Обычно значения формул вычисляются лениво при
+    // чтении; здесь независимые формулы считаются одновременно. Для
+    // многопоточного доступа это чтение (см. описание класса).
+    void RecalculateAll(size_t threads = 0);
+
+    // Когда вычисляются формулы, зависящие от изменённых ячеек. LAZY (по
+    // умолчанию): изменение только сбрасывает кэши всех зависимых, а формулы
+    // вычисляются при чтении. EAGER: изменение сразу пересчитывает зависимые
+    // в топологическом порядке, и ниже ячейки, значение которой не
+    // изменилось, пересчёт не идёт; формулы, устаревшие до включения,
+    // по-прежнему вычисляются при чтении. Менять режим можно, пока с листом
+    // никто не работает.
+    enum class RecalculationMode {
+        LAZY,
+        EAGER,
+    };
+    void SetRecalculationMode(RecalculationMode mode) {
+        recalculation_mode_ = mode;
+    }
+    RecalculationMode GetRecalculationMode() const {
+        return recalculation_mode_;
+    }
+
+    // Фоновый пересчёт: отдельный поток вычисляет устаревшие формулы, сначала
+    // в области просмотра (SetViewport), затем во всём листе. Поток работает
+    // как читатель (см. описание класса) и между ячейками пропускает
+    // писателей вперёд; после каждого изменения листа или области просмотра
+    // он начинает заново. Запускать и останавливать его нужно, пока с листом
+    // никто не работает; деструктор останавливает его сам.
+    void StartBackgroundRecalculation();
+    void StopBackgroundRecalculation();
+
+    // Область, которую фоновый пересчёт вычисляет первой; std::nullopt - нет
+    // такой области. Можно вызывать из любого потока в любой момент
+    void SetViewport(std::optional<Range> viewport);
+
+    // Значение ячейки, не дожидаясь вычисления (см. Cell::TryGetValue). Для
+    // многопоточного доступа это чтение
+    Cell::KnownValue TryGetValue(Position pos) const;
+
+    // Неизменяемая копия листа на текущий момент: тексты, значения и ссылки
+    // ячеек. Снимки разделяют неизменившиеся части друг с другом, поэтому
+    // снимок стоит O(числа ячеек, изменившихся с предыдущего снимка); первый
+    // снимок проходит весь лист. Снимок не зависит от листа и может его
+    // пережить. Для многопоточного доступа это чтение.
+    std::shared_ptr<const SheetInterface> Snapshot();
+
+    // Счётчики работы листа (см. SheetStatsReport). Изначально выключены;
+    // включать, выключать и сбрасывать их нужно, пока с листом никто не
+    // работает. Состояние листа (ячейки, рёбра, память) отчёт содержит всегда.
+    // GetStats проходит все ячейки; для многопоточного доступа это чтение.
+    void EnableStats(bool enabled = true);
+    void ResetStats();
+    SheetStatsReport GetStats() const;
+
+    // Куда ячейки записывают счётчики
+    const SheetStats& GetStatsRecorder() const {
+        return stats_;
+    }
+
+    // Отмечает ячейку, изменившуюся (текстом или значением) со времени
+    // последнего снимка. Ничего не делает, пока нет живых снимков
+    void NoteChanged(Position pos) {
+        if (track_changes_) {
+            const int key = (pos.row >> CellStorage::TILE_SHIFT) * CellStorage::TILE_COLS
+                            + (pos.col >> CellStorage::TILE_SHIFT);
+            changed_tiles_[key].set(CellStorage::IndexInTile(pos));
+        }
+    }
+
+    // Блокировка чтения для многопоточного доступа (см. описание класса)
+    std::shared_lock<ReadWriteMutex> LockForReading() const;
+
+    // Под этим мьютексом вычисляются устаревшие формулы (см. Cell::GetValue)
+    std::mutex& GetRecalculationMutex() const {
+        return recalculation_mutex_;
+    }
+
     const Cell* GetConcreteCell(Position pos) const;
     Cell* GetConcreteCell(Position pos);
 
+    // Создаёт пустую ячейку в свободной (корректной) позиции
+    Cell* CreateCell(Position pos);
+
+    // Переиспользуемые буферы для обходов графа зависимостей
+    struct TraversalBuffers {
+        std::vector<Cell*> stack;
+        std::vector<Cell*> forward;
+        std::vector<Cell*> backward;
+        std::vector<int64_t> orders;
+    };
+
+    // Формулы, ссылающиеся на диапазоны. Ячейка из диапазона не хранит рёбер к
+    // таким формулам: зависимые ищутся в индексе (см. Cell::ForEachDependent)
+    void AddRangeDependent(Cell* cell, const std::vector<Range>& ranges) {
+        range_index_.Add(cell, ranges);
+    }
+    void RemoveRangeDependent(Cell* cell) {
+        range_index_.Remove(cell);
+    }
+    template <typename Func>
+    void ForEachRangeDependent(Position pos, Func&& func) const {
+        range_index_.ForEachCovering(pos, std::forward<Func>(func));
+    }
+
+    // Столбцовое хранилище значений (см. CellStorage::Tile)
+    CellStorage::StoredValue GetStoredValue(Position pos) const {
+        return cells_.GetValue(pos);
+    }
+    template <typename Func>
+    void ForEachValueRun(const Range& range, Func&& func) const {
+        cells_.ForEachValueRun(range, std::forward<Func>(func));
+    }
+
+    // Обходит существующие ячейки диапазона
+    template <typename Func>
+    void ForEachCellInRange(const Range& range, Func&& func) const {
+        cells_.ForEachInRange(range, std::forward<Func>(func));
+    }
+
+    // Общие для ячеек листа разобранные формулы
+    FormulaCache& GetFormulaCache() {
+        return formula_cache_;
+    }
+
+    // Обходы графа зависимостей (используются Cell): каждый обход получает
+    // новый номер, которым помечаются посещённые ячейки, и переиспользует общие
+    // буферы, поэтому не выделяет память
+    uint64_t StartTraversal();
+    TraversalBuffers& GetTraversalBuffers() {
+        return traversal_buffers_;
+    }
+
+    // Номера топологического порядка для новых ячеек: после всех выданных
+    // ранее или перед ними. Новая ячейка без рёбер может стоять где угодно,
+    // см. Cell::CheckCircularDependency
+    int64_t TakeOrderAfterAll() {
+        return ++max_order_;
+    }
+    int64_t TakeOrderBeforeAll() {
+        return --min_order_;
+    }
+
 private:
-    template<typename T>
-    void ResizeIfNeeded(std::vector<T>& vec, int idx) {
-        if (idx >= static_cast<int>(vec.size())) {
-            vec.resize(idx + 1);
+    // Счётчик непустых ячеек по строкам (или столбцам). Хранит индекс за
+    // последней непустой линией, поэтому размер печатной области всегда
+    // известен, а при очистке граница сдвигается только через опустевшие линии.
+    class NonEmptyCounter {
+    public:
+        void Add(int index);
+        void Remove(int index);
+
+        int GetBound() const {
+            return bound_;
         }
-    }
 
-    void MaybeIncreaseSizeToIncludePosition(Position pos);
-    void PrintCells(std::ostream& output,
-                    const std::function<void(const CellInterface&)>& printCell) const;
-    Size GetActualSize() const;
+    private:
+        std::vector<int> counts_;
+        int bound_ = 0;
+    };
+
+    // Замороженное состояние листа для снимков. Хранится двумя уровнями
+    // (строки тайлов, в них тайлы) с разделяемыми узлами: снимок копирует
+    // только корень, а при обновлении копируются лишь узлы, которые
+    // разделены со снимками (копирование путей).
+    struct FrozenCell;
+    struct FrozenTile {
+        std::array<std::shared_ptr<const FrozenCell>, CellStorage::TILE_CELLS> cells;
+    };
+    using FrozenRow = std::array<std::shared_ptr<FrozenTile>, CellStorage::TILE_COLS>;
+    using FrozenImage = std::array<std::shared_ptr<FrozenRow>, CellStorage::TILE_ROWS>;
+    class SnapshotSheet;
+
+    // Разбирает записи, которые меняют лист (из повторов позиции - последнюю;
+    // cells упорядочены по позиции), и добавляет их в конец contents
+    void ParseChanged(std::vector<std::pair<Position, std::string>>& cells, size_t parse_threads,
+                      std::vector<std::pair<Position, Cell::Content>>& contents);
+    std::vector<std::optional<Cell::Content>> ParseContents(
+        const std::vector<std::pair<Position, std::string>*>& cells, size_t threads);
+    // Записывает разобранные ячейки (позиции различны) одним пакетом, см.
+    // SetCells. Без invalidate кэши зависимых формул не сбрасываются: так
+    // можно, только если записанное не меняет ни одного готового значения
+    void ApplyContents(std::vector<std::pair<Position, Cell::Content>> contents, bool invalidate);
+    void UpdatePrintableArea(Position pos, bool was_empty, bool is_empty);
+    std::unique_lock<ReadWriteMutex> LockForWriting();
+    void RunBackgroundRecalculation();
+    void Freeze(Position pos);
+    void DropUnusedSnapshotState();
+
+    mutable ReadWriteMutex access_mutex_;
+    mutable std::mutex recalculation_mutex_;
+
+    CellStorage cells_;
+    NonEmptyCounter row_counter_;
+    NonEmptyCounter col_counter_;
+
+    // Куда записывать позиции созданных ячеек, пока идёт SetCells:
+    // при откате пакета они удаляются
+    std::vector<Position>* created_cells_ = nullptr;
+
+    uint64_t traversal_epoch_ = 0;
+    TraversalBuffers traversal_buffers_;
+
+    RangeIndex range_index_;
+    SheetStats stats_;
+    FormulaCache formula_cache_{&stats_};
+
+    int64_t min_order_ = 0;
+    int64_t max_order_ = 0;
+
+    RecalculationMode recalculation_mode_ = RecalculationMode::LAZY;
+
+    // Фоновый пересчёт. Номер поколения растёт с каждым изменением листа и
+    // области просмотра; поток, увидевший новый номер, начинает заново
+    std::thread worker_;
+    std::mutex worker_mutex_;
+    std::condition_variable worker_wakeup_;
+    std::atomic<uint64_t> worker_generation_{0};
+    std::atomic<bool> worker_stop_{false};
+    std::optional<Range> viewport_;
 
-    std::vector<std::vector<std::unique_ptr<Cell>>> cells_;
+    // Снимки. frozen_ - замороженная копия листа, общая по узлам с
+    // последним снимком; изменённые с тех пор ячейки отмечены битами своих
+    // тайлов. Когда последний снимок удалён, копия и отметки сбрасываются
+    mutable std::mutex snapshot_mutex_;
+    FrozenImage frozen_;
+    std::weak_ptr<const FrozenImage> last_image_;
+    std::unordered_map<int, std::bitset<CellStorage::TILE_CELLS>> changed_tiles_;
+    bool track_changes_ = false;
 };
 
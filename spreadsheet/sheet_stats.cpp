@@ -0,0 +1,107 @@
+#include "sheet_stats.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace {
+
+size_t BucketOf(uint64_t value) {
+    size_t bucket = 0;
+    while (value != 0 && bucket + 1 < StatsHistogram::BUCKETS) {
+        value >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+}  // namespace
+
+SheetStats::SheetStats() = default;
+
+SheetStats::~SheetStats() = default;
+
+void SheetStats::SetEnabled(bool enabled) {
+    if (!STATS_COMPILED) {
+        return;
+    }
+    if (enabled && !shards_) {
+        shards_ = std::make_unique<Shard[]>(SHARDS);
+    }
+    enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+SheetStats::Shard& SheetStats::GetShard() const {
+    // номер полосы потока выдаётся один раз, по кругу
+    static std::atomic<size_t> next_index{0};
+    thread_local const size_t index = next_index.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+    return shards_[index];
+}
+
+void SheetStats::RecordToShard(Histogram histogram, uint64_t value) const {
+    HistogramShard& shard = GetShard().histograms[static_cast<size_t>(histogram)];
+    shard.buckets[BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    shard.count.fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = shard.max.load(std::memory_order_relaxed);
+    while (value > max && !shard.max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+void SheetStats::Collect(SheetStatsReport& report) const {
+    if (!shards_) {
+        return;
+    }
+
+    uint64_t* const counters[] = {
+        &report.formula_parses,
+        &report.formula_template_hits,
+        &report.parse_nanoseconds,
+        &report.cache_hits,
+        &report.cache_misses,
+        &report.evaluations,
+    };
+    static_assert(std::size(counters) == static_cast<size_t>(Counter::COUNT));
+    StatsHistogram* const histograms[] = {
+        &report.evaluations_per_recalculation,
+        &report.invalidation_fan_out,
+        &report.cycle_check_visits,
+    };
+    static_assert(std::size(histograms) == static_cast<size_t>(Histogram::COUNT));
+
+    for (size_t i = 0; i < SHARDS; ++i) {
+        const Shard& shard = shards_[i];
+        for (size_t c = 0; c < std::size(counters); ++c) {
+            *counters[c] += shard.counters[c].load(std::memory_order_relaxed);
+        }
+        for (size_t h = 0; h < std::size(histograms); ++h) {
+            const HistogramShard& from = shard.histograms[h];
+            StatsHistogram& to = *histograms[h];
+            for (size_t b = 0; b < StatsHistogram::BUCKETS; ++b) {
+                to.buckets[b] += from.buckets[b].load(std::memory_order_relaxed);
+            }
+            to.count += from.count.load(std::memory_order_relaxed);
+            to.sum += from.sum.load(std::memory_order_relaxed);
+            to.max = std::max(to.max, from.max.load(std::memory_order_relaxed));
+        }
+    }
+}
+
+void SheetStats::Reset() {
+    if (!shards_) {
+        return;
+    }
+    for (size_t i = 0; i < SHARDS; ++i) {
+        Shard& shard = shards_[i];
+        for (auto& counter : shard.counters) {
+            counter.store(0, std::memory_order_relaxed);
+        }
+        for (HistogramShard& histogram : shard.histograms) {
+            for (auto& bucket : histogram.buckets) {
+                bucket.store(0, std::memory_order_relaxed);
+            }
+            histogram.count.store(0, std::memory_order_relaxed);
+            histogram.sum.store(0, std::memory_order_relaxed);
+            histogram.max.store(0, std::memory_order_relaxed);
+        }
+    }
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Счётчики работы листа (см. Sheet::GetStats). Включаются во время работы
+// (EnableStats); пока они выключены, запись стоит одной проверки флага. Если
+// при сборке определён SPREADSHEET_NO_STATS, запись вырезается целиком.
+//
+// Чтобы потоки не спорили за одни и те же строки кэша, у каждого потока своя
+// полоса счётчиков (потоков больше, чем полос, - полосы делятся); при чтении
+// полосы складываются.
+
+#ifdef SPREADSHEET_NO_STATS
+inline constexpr bool STATS_COMPILED = false;
+#else
+inline constexpr bool STATS_COMPILED = true;
+#endif
+
+// Распределение значений по степеням двойки: buckets[0] - нули, buckets[i] -
+// значения из [2^(i-1), 2^i)
+struct StatsHistogram {
+    static constexpr size_t BUCKETS = 32;
+
+    std::array<uint64_t, BUCKETS> buckets{};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    double GetMean() const {
+        return count == 0 ? 0 : static_cast<double>(sum) / count;
+    }
+};
+
+struct SheetStatsReport {
+    // Разбор формул: сколько раз разбирался текст, сколько раз нашёлся уже
+    // разобранный шаблон (см. FormulaCache) и сколько на это ушло времени
+    uint64_t formula_parses = 0;
+    uint64_t formula_template_hits = 0;
+    uint64_t parse_nanoseconds = 0;
+
+    // Чтения значений формульных ячеек: кэш был готов или устарел
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+
+    // Вычисления формул и их число за один пересчёт (промах кэша или
+    // RecalculateAll)
+    uint64_t evaluations = 0;
+    StatsHistogram evaluations_per_recalculation;
+
+    // Сколько кэшей сбросило одно изменение
+    StatsHistogram invalidation_fan_out;
+
+    // Сколько ячеек обошла одна проверка на циклы
+    StatsHistogram cycle_check_visits;
+
+    // Состояние листа на момент чтения
+    size_t live_cells = 0;
+    size_t edges = 0;  // ссылки ячеек на ячейки (без диапазонов)
+
+    // Память по частям листа, в байтах. Оценка: служебные данные кучи и
+    // объекты самих формул (FormulaInterface) не учитываются
+    struct Memory {
+        size_t tiles = 0;          // тайлы хранилища ячеек
+        size_t cell_pool = 0;      // пул ячеек
+        size_t edges = 0;          // списки рёбер, не поместившиеся в ячейку
+        size_t contents = 0;       // содержимое ячеек: тексты, данные формул
+        size_t formulas = 0;       // разобранные выражения (деревья и программы);
+                                   // общий шаблон считается один раз
+        size_t formula_cache = 0;  // таблица шаблонов FormulaCache
+        size_t range_index = 0;    // индекс диапазонов
+        size_t snapshots = 0;      // замороженная копия листа для снимков
+    } memory;
+};
+
+// Оценки памяти стандартных контейнеров в куче, для отчёта
+
+// Строка в куче, если не уместилась в самом объекте
+inline size_t StringHeapBytes(const std::string& str) {
+    const std::less<const void*> less;
+    const bool inline_buffer = !less(str.data(), &str) && less(str.data(), &str + 1);
+    return inline_buffer ? 0 : str.capacity() + 1;
+}
+
+template <typename T>
+size_t VectorHeapBytes(const std::vector<T>& vector) {
+    return vector.capacity() * sizeof(T);
+}
+
+// Корзины и узлы хеш-таблицы (узел - элемент и указатель на следующий)
+template <typename Map>
+size_t HashMapBytes(const Map& map) {
+    return map.bucket_count() * sizeof(void*)
+           + map.size() * (sizeof(typename Map::value_type) + sizeof(void*));
+}
+
+class SheetStats {
+public:
+    enum class Counter {
+        FORMULA_PARSES,
+        FORMULA_TEMPLATE_HITS,
+        PARSE_NANOSECONDS,
+        CACHE_HITS,
+        CACHE_MISSES,
+        EVALUATIONS,
+        COUNT,
+    };
+
+    enum class Histogram {
+        EVALUATIONS_PER_RECALCULATION,
+        INVALIDATION_FAN_OUT,
+        CYCLE_CHECK_VISITS,
+        COUNT,
+    };
+
+    SheetStats();
+    ~SheetStats();
+
+    // Включать и выключать нужно, пока с листом никто не работает
+    void SetEnabled(bool enabled);
+
+    bool IsEnabled() const {
+        return STATS_COMPILED && enabled_.load(std::memory_order_relaxed);
+    }
+
+    void Add(Counter counter, uint64_t value = 1) const {
+        if (IsEnabled()) {
+            GetShard().counters[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+        }
+    }
+
+    void Record(Histogram histogram, uint64_t value) const {
+        if (IsEnabled()) {
+            RecordToShard(histogram, value);
+        }
+    }
+
+    // Добавляет к счётчику время (в наносекундах) от создания до уничтожения.
+    // Если счётчики выключены или stats == nullptr, время не замеряется
+    class Timer {
+    public:
+        Timer(const SheetStats* stats, Counter counter)
+            : stats_(stats && stats->IsEnabled() ? stats : nullptr)
+            , counter_(counter) {
+            if (stats_) {
+                start_ = std::chrono::steady_clock::now();
+            }
+        }
+
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        ~Timer() {
+            if (stats_) {
+                const auto elapsed = std::chrono::steady_clock::now() - start_;
+                stats_->Add(counter_, static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+            }
+        }
+
+    private:
+        const SheetStats* stats_;
+        Counter counter_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    // Складывает полосы в счётчики и гистограммы report
+    void Collect(SheetStatsReport& report) const;
+    void Reset();
+
+private:
+    struct HistogramShard {
+        std::array<std::atomic<uint64_t>, StatsHistogram::BUCKETS> buckets{};
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> sum{0};
+        std::atomic<uint64_t> max{0};
+    };
+
+    struct alignas(64) Shard {
+        std::array<std::atomic<uint64_t>, static_cast<size_t>(Counter::COUNT)> counters{};
+        std::array<HistogramShard, static_cast<size_t>(Histogram::COUNT)> histograms{};
+    };
+
+    static constexpr size_t SHARDS = 16;
+
+    Shard& GetShard() const;
+    void RecordToShard(Histogram histogram, uint64_t value) const;
+
+    std::atomic<bool> enabled_{false};
+    std::unique_ptr<Shard[]> shards_;  // создаются при первом включении
+};
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+// Вектор с N элементами, хранящимися прямо в объекте. Пока элементов не больше
+// N, память в куче не выделяется; дальше элементы переезжают в непрерывный
+// буфер в куче. Предназначен для простых типов (указатели, небольшие структуры),
+// поэтому элементы копируются побитово.
+template <typename T, size_t N>
+class SmallVector {
+    static_assert(std::is_trivially_copyable_v<T>, "SmallVector stores trivially copyable types only");
+
+public:
+    SmallVector() = default;
+    SmallVector(const SmallVector&) = delete;
+    SmallVector& operator=(const SmallVector&) = delete;
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    // Память в куче под элементы, не поместившиеся в объект
+    size_t heap_bytes() const {
+        return heap_ ? capacity_ * sizeof(T) : 0;
+    }
+
+    T* begin() {
+        return data_;
+    }
+
+    T* end() {
+        return data_ + size_;
+    }
+
+    const T* begin() const {
+        return data_;
+    }
+
+    const T* end() const {
+        return data_ + size_;
+    }
+
+    T& operator[](size_t index) {
+        assert(index < size_);
+        return data_[index];
+    }
+
+    const T& operator[](size_t index) const {
+        assert(index < size_);
+        return data_[index];
+    }
+
+    T& back() {
+        assert(size_ > 0);
+        return data_[size_ - 1];
+    }
+
+    void push_back(const T& value) {
+        if (size_ == capacity_) {
+            Grow();
+        }
+        data_[size_++] = value;
+    }
+
+    void pop_back() {
+        assert(size_ > 0);
+        --size_;
+    }
+
+    // Удаляет все элементы и возвращается к встроенному буферу
+    void clear() {
+        heap_.reset();
+        data_ = inline_;
+        size_ = 0;
+        capacity_ = N;
+    }
+
+private:
+    void Grow() {
+        const uint32_t new_capacity = capacity_ * 2;
+        auto new_heap = std::make_unique<T[]>(new_capacity);
+        std::copy(data_, data_ + size_, new_heap.get());
+        heap_ = std::move(new_heap);
+        data_ = heap_.get();
+        capacity_ = new_capacity;
+    }
+
+    T inline_[N];
+    std::unique_ptr<T[]> heap_;
+    T* data_ = inline_;
+    uint32_t size_ = 0;
+    uint32_t capacity_ = N;
+};
@@ -3,6 +3,7 @@
 #include <cctype>
 #include <sstream>
 #include <algorithm>
+#include <tuple>
 
 const int LETTERS = 26;
 const int MAX_POSITION_LENGTH = 17;
@@ -95,3 +96,45 @@ Position Position::FromString(std::string_view str) {
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
+
+const Range Range::NONE = {Position::NONE, Position::NONE};
+
+bool Range::operator==(Range rhs) const {
+    return from == rhs.from && to == rhs.to;
+}
+
+bool Range::operator<(Range rhs) const {
+    return std::tie(from, to) < std::tie(rhs.from, rhs.to);
+}
+
+bool Range::IsValid() const {
+    return from.IsValid() && to.IsValid() && from.row <= to.row && from.col <= to.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= from.row && pos.row <= to.row && pos.col >= from.col && pos.col <= to.col;
+}
+
+std::string Range::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+    return from.ToString() + ':' + to.ToString();
+}
+
+Range Range::FromString(std::string_view str) {
+    const size_t colon = str.find(':');
+    if (colon == std::string_view::npos) {
+        return NONE;
+    }
+
+    const Position first = Position::FromString(str.substr(0, colon));
+    const Position second = Position::FromString(str.substr(colon + 1));
+    if (!first.IsValid() || !second.IsValid()) {
+        return NONE;
+    }
+
+    // приводим к виду "левый верхний:правый нижний"
+    return {{std::min(first.row, second.row), std::min(first.col, second.col)},
+            {std::max(first.row, second.row), std::max(first.col, second.col)}};
+}